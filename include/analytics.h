@@ -0,0 +1,55 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace analytics {
+    // Totals of one tick, accumulated cell by cell over the open cells
+    // before the tick applies any force. Masses are densities summed over cells; the kinetic term
+    // is half the density times the squared velocities of a cell.
+    struct FieldStats {
+        std::array<double, 256> mass{};
+        double total_mass{0};
+        double weighted_x{0}, weighted_y{0};
+        double kinetic{0};
+        size_t outlet_fluid{0};
+
+        void reset() { *this = FieldStats{}; }
+
+        void addCell(size_t x, size_t y, char type, double rho, double v2, bool outlet) {
+            mass[static_cast<unsigned char>(type)] += rho;
+            total_mass += rho;
+            weighted_x += rho * static_cast<double>(x);
+            weighted_y += rho * static_cast<double>(y);
+            kinetic += 0.5 * rho * v2;
+            outlet_fluid += outlet && type != ' ';
+        }
+    };
+
+    // Writes one FieldStats row per sampled tick. Columns are the tick, the
+    // mass of every material present in the map, the centre of mass, the
+    // kinetic term and the outlet fill level: the fraction of the open
+    // cells of the lowest open row that hold something other than air.
+    // CSV has a header line. The binary format is the magic "FSTS", the
+    // column count as uint32, the NUL-terminated column names, then rows
+    // of doubles in native byte order.
+    class StatsWriter {
+    public:
+        StatsWriter(const std::string& path, bool binary, const std::vector<std::string>& field_data);
+
+        // Lowest row holding an open cell; its open cells are the outlet.
+        size_t outletRow() const { return outlet_row; }
+
+        void write(size_t tick, const FieldStats& stats);
+
+    private:
+        std::ofstream out;
+        bool binary;
+        std::string materials;
+        size_t outlet_row{0};
+        size_t outlet_cells{0};
+        std::vector<double> row;
+    };
+}
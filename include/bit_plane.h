@@ -0,0 +1,143 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <bit>
+#include <cassert>
+
+// One bit per cell, 64 cells of a row per word. Rows are padded to whole
+// words and the padding bits are always zero, so whole-row operations can
+// work word by word without masking the tail.
+class BitPlane {
+public:
+    using word_type = uint64_t;
+    static constexpr size_t WORD_BITS = 64;
+
+    BitPlane() = default;
+
+    void init(size_t rows, size_t cols) {
+        n_rows = rows;
+        n_cols = cols;
+        n_words = (cols + WORD_BITS - 1) / WORD_BITS;
+        bits.assign(rows * n_words, 0);
+    }
+
+    void clear() {
+        std::fill(bits.begin(), bits.end(), 0);
+    }
+
+    bool test(size_t x, size_t y) const {
+        assert(x < n_rows && y < n_cols);
+        return (bits[x * n_words + y / WORD_BITS] >> (y % WORD_BITS)) & 1u;
+    }
+
+    void set(size_t x, size_t y) {
+        assert(x < n_rows && y < n_cols);
+        bits[x * n_words + y / WORD_BITS] |= word_type(1) << (y % WORD_BITS);
+    }
+
+    void reset(size_t x, size_t y) {
+        assert(x < n_rows && y < n_cols);
+        bits[x * n_words + y / WORD_BITS] &= ~(word_type(1) << (y % WORD_BITS));
+    }
+
+    void assign(size_t x, size_t y, bool value) {
+        if (value) {
+            set(x, y);
+        } else {
+            reset(x, y);
+        }
+    }
+
+    word_type word(size_t x, size_t w) const { return bits[x * n_words + w]; }
+    word_type& word(size_t x, size_t w) { return bits[x * n_words + w]; }
+
+    // Bits of row x shifted so that bit y holds cell (x, y - 1), i.e. each
+    // cell sees its left neighbour; bit 0 sees nothing.
+    word_type left_neighbours(size_t x, size_t w) const {
+        word_type carry = w > 0 ? word(x, w - 1) >> (WORD_BITS - 1) : 0;
+        return (word(x, w) << 1) | carry;
+    }
+
+    // Bits of row x shifted so that bit y holds cell (x, y + 1).
+    word_type right_neighbours(size_t x, size_t w) const {
+        word_type carry = w + 1 < n_words ? word(x, w + 1) << (WORD_BITS - 1) : 0;
+        return (word(x, w) >> 1) | carry;
+    }
+
+    // First column >= y in row x whose bit is clear and whose bit in `mask`
+    // is clear too, or cols() if there is none. Runs of set cells are
+    // skipped a word at a time.
+    size_t next_clear(size_t x, size_t y, const BitPlane& mask) const {
+        while (y < n_cols) {
+            size_t w = y / WORD_BITS;
+            word_type free_cells = ~(word(x, w) | mask.word(x, w));
+            free_cells &= ~word_type(0) << (y % WORD_BITS);
+            if (free_cells != 0) {
+                return std::min(n_cols, w * WORD_BITS + std::countr_zero(free_cells));
+            }
+            y = (w + 1) * WORD_BITS;
+        }
+        return n_cols;
+    }
+
+    void clear_row(size_t x) {
+        std::fill_n(bits.begin() + x * n_words, n_words, 0);
+    }
+
+    size_t count_row(size_t x) const {
+        size_t count = 0;
+        for (size_t w = 0; w < n_words; ++w) {
+            count += std::popcount(word(x, w));
+        }
+        return count;
+    }
+
+    size_t rows() const { return n_rows; }
+    size_t cols() const { return n_cols; }
+    size_t words_per_row() const { return n_words; }
+
+private:
+    size_t n_rows{0}, n_cols{0}, n_words{0};
+    std::vector<word_type> bits;
+};
+
+// Word w of row x of a plane given by word(row, w), shifted so that each
+// cell sees its neighbour at (x + dx, y + dy) for dx, dy in -1..1; cells
+// whose neighbour is outside the plane see zero. Padding bits of the
+// result are not cleared.
+template<typename Word>
+uint64_t neighbour_bits(Word word, size_t rows, size_t words, size_t x, size_t w, int dx, int dy) {
+    size_t nx = x + dx;
+    if (nx >= rows) {
+        return 0;
+    }
+    uint64_t bits = word(nx, w);
+    if (dy > 0) {
+        uint64_t carry = w + 1 < words ? word(nx, w + 1) << (BitPlane::WORD_BITS - 1) : 0;
+        return (bits >> 1) | carry;
+    }
+    if (dy < 0) {
+        uint64_t carry = w > 0 ? word(nx, w - 1) >> (BitPlane::WORD_BITS - 1) : 0;
+        return (bits << 1) | carry;
+    }
+    return bits;
+}
+
+// Number of set cells among the four neighbours of every cell, as three
+// bit-sliced count planes: count = b0 + 2 * b1 + 4 * b2 for each bit.
+inline void count_neighbours(const BitPlane& plane, size_t x, size_t w,
+                             uint64_t& b0, uint64_t& b1, uint64_t& b2) {
+    uint64_t up = x > 0 ? plane.word(x - 1, w) : 0;
+    uint64_t down = x + 1 < plane.rows() ? plane.word(x + 1, w) : 0;
+    uint64_t left = plane.left_neighbours(x, w);
+    uint64_t right = plane.right_neighbours(x, w);
+
+    uint64_t s0 = up ^ down, c0 = up & down;
+    uint64_t s1 = left ^ right, c1 = left & right;
+    b0 = s0 ^ s1;
+    uint64_t c2 = s0 & s1;
+    b1 = c0 ^ c1 ^ c2;
+    b2 = (c0 & c1) | (c0 & c2) | (c1 & c2);
+}
@@ -0,0 +1,182 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+// Which BLOCK x BLOCK blocks of a map hold at least one open cell. Only
+// those get storage in a block-sparse field; all-wall blocks share a
+// single block holding the field's initial value. One layout is shared by
+// every field of a simulator.
+struct BlockLayout {
+    static constexpr size_t BLOCK_BITS = 3;
+    static constexpr size_t BLOCK = size_t(1) << BLOCK_BITS;
+    static constexpr size_t BLOCK_CELLS = BLOCK * BLOCK;
+
+    size_t rows{0}, cols{0};
+    size_t block_rows{0}, block_cols{0};
+    // Storage slot of every block; slot 0 is the shared all-wall block.
+    std::vector<uint32_t> slots;
+    size_t allocated{0};
+
+    static BlockLayout from_field(const std::vector<std::string>& field, size_t rows, size_t cols) {
+        BlockLayout layout;
+        layout.rows = rows;
+        layout.cols = cols;
+        layout.block_rows = (rows + BLOCK - 1) / BLOCK;
+        layout.block_cols = (cols + BLOCK - 1) / BLOCK;
+        layout.slots.assign(layout.block_rows * layout.block_cols, 0);
+        for (size_t x = 0; x < rows; ++x) {
+            for (size_t y = 0; y < cols; ++y) {
+                uint32_t& slot = layout.slots[(x >> BLOCK_BITS) * layout.block_cols + (y >> BLOCK_BITS)];
+                if (field[x][y] != '#' && slot == 0) {
+                    slot = static_cast<uint32_t>(++layout.allocated);
+                }
+            }
+        }
+        return layout;
+    }
+
+    // Offset of cell (x, y) in the storage of a block-sparse field.
+    size_t index(size_t x, size_t y) const {
+        assert(x < rows && y < cols);
+        size_t slot = slots[(x >> BLOCK_BITS) * block_cols + (y >> BLOCK_BITS)];
+        return slot * BLOCK_CELLS + ((x & (BLOCK - 1)) << BLOCK_BITS) + (y & (BLOCK - 1));
+    }
+};
+
+// Field stored in BlockLayout blocks, with the interface of Grid except
+// that rows are not contiguous: grid[x] returns a row handle rather than a
+// pointer, and block_row() gives the contiguous run of a row inside one
+// block. Cells of all-wall blocks alias one shared block, so they must
+// only ever be written with the initial value.
+template<typename T>
+class BlockSparseGrid {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    static constexpr bool contiguous = false;
+
+    class Row {
+    public:
+        Row(BlockSparseGrid* grid, size_type x) : grid(grid), x(x) {}
+        T& operator[](size_type y) const { return grid->data[grid->layout->index(x, y)]; }
+
+    private:
+        BlockSparseGrid* grid;
+        size_type x;
+    };
+
+    class ConstRow {
+    public:
+        ConstRow(const BlockSparseGrid* grid, size_type x) : grid(grid), x(x) {}
+        const T& operator[](size_type y) const { return grid->data[grid->layout->index(x, y)]; }
+
+    private:
+        const BlockSparseGrid* grid;
+        size_type x;
+    };
+
+    BlockSparseGrid() = default;
+
+    void set_layout(std::shared_ptr<const BlockLayout> new_layout) {
+        layout = std::move(new_layout);
+    }
+
+    void init(size_type rows, size_type cols, const T& value = T()) {
+        if (!layout || layout->rows != rows || layout->cols != cols) {
+            throw std::runtime_error("Block-sparse field initialised without a matching layout");
+        }
+        data.assign((layout->allocated + 1) * BlockLayout::BLOCK_CELLS, value);
+    }
+
+    Row operator[](size_type x) { return Row(this, x); }
+    ConstRow operator[](size_type x) const { return ConstRow(this, x); }
+
+    T* cell(size_type x, size_type y) { return data.data() + layout->index(x, y); }
+    const T* cell(size_type x, size_type y) const { return data.data() + layout->index(x, y); }
+
+    // Cells (x, y) .. (x, block_row_end(y) - 1) are contiguous from here.
+    T* block_row(size_type x, size_type y) { return cell(x, y); }
+    const T* block_row(size_type x, size_type y) const { return cell(x, y); }
+    size_type block_row_end(size_type y) const {
+        return std::min(layout->cols, (y | (BlockLayout::BLOCK - 1)) + 1);
+    }
+
+    // Sets every cell, the shared all-wall block included.
+    void fill(const T& value) { std::fill(data.begin(), data.end(), value); }
+
+    size_type rows() const { return layout ? layout->rows : 0; }
+    size_type cols() const { return layout ? layout->cols : 0; }
+    bool empty() const { return data.empty(); }
+    size_type allocated_cells() const { return data.size(); }
+
+private:
+    std::shared_ptr<const BlockLayout> layout;
+    std::vector<T> data;
+};
+
+// Per-cell velocities on a BlockSparseGrid, with the interface of
+// VectorField.
+template<typename T, size_t D = 4>
+class SparseVectorField {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using delta_array = std::array<std::pair<int, int>, D>;
+    using cell_type = std::array<T, D>;
+
+    void set_layout(std::shared_ptr<const BlockLayout> layout) {
+        cells.set_layout(std::move(layout));
+    }
+
+    void init(size_type rows, size_type cols) {
+        cell_type zero;
+        zero.fill(T(0));
+        cells.init(rows, cols, zero);
+    }
+
+    T& add(size_type x, size_type y, int dx, int dy, T dv, const delta_array& deltas) {
+        auto it = std::find(deltas.begin(), deltas.end(), std::make_pair(dx, dy));
+        if (it == deltas.end()) {
+            throw std::runtime_error("Invalid delta values");
+        }
+        return (*cells.cell(x, y))[std::distance(deltas.begin(), it)] += dv;
+    }
+
+    T& get(size_type x, size_type y, int dx, int dy, const delta_array& deltas) {
+        size_t i = std::distance(deltas.begin(), std::find(deltas.begin(), deltas.end(), std::make_pair(dx, dy)));
+        return (*cells.cell(x, y))[i];
+    }
+
+    void reset() {
+        cell_type zero;
+        zero.fill(T(0));
+        cells.fill(zero);
+    }
+
+    const T& at(size_type x, size_type y, size_type i) const {
+        assert(i < D);
+        return (*cells.cell(x, y))[i];
+    }
+
+    T& at(size_type x, size_type y, size_type i) {
+        assert(i < D);
+        return (*cells.cell(x, y))[i];
+    }
+
+    size_type rows() const { return cells.rows(); }
+    size_type cols() const { return cells.cols(); }
+    bool empty() const { return cells.empty(); }
+
+    cell_type get_array(size_t x, size_t y) const { return *cells.cell(x, y); }
+    void set_array(size_t x, size_t y, const cell_type& arr) { *cells.cell(x, y) = arr; }
+
+private:
+    BlockSparseGrid<cell_type> cells;
+};
@@ -4,7 +4,21 @@
 #include <stdexcept>
 #include <tuple>
 #include <vector>
+#include <array>
+#include <sstream>
+#include <string_view>
 #include "fixed.h"
+#include "simulator_factory.h"
+#include "scenario.h"
+#include "embedded_maps.h"
+
+#ifndef SIZES
+#define SIZES ""
+#endif
+
+#ifndef WIDTHS
+#define WIDTHS ""
+#endif
 
 using SupportedTypes = std::tuple<
     float,
@@ -92,11 +106,121 @@ typename std::tuple_element_t<0, Tuple> find_matching_type(const TypeInfo& info)
     }
 }
 
+// Map extents listed in SIZES as "S(rows,cols),...", parsed at compile
+// time. A map whose size matches one of them exactly runs on an engine
+// with static storage of that size.
+struct Extent {
+    size_t rows{0};
+    size_t cols{0};
+};
+
+constexpr size_t count_extents(std::string_view list) {
+    size_t count = 0;
+    for (size_t pos = list.find("S("); pos != std::string_view::npos; pos = list.find("S(", pos + 2)) {
+        ++count;
+    }
+    return count;
+}
+
+constexpr size_t parse_extent_number(std::string_view list, size_t& pos) {
+    while (pos < list.size() && (list[pos] < '0' || list[pos] > '9')) {
+        ++pos;
+    }
+    size_t value = 0;
+    for (; pos < list.size() && list[pos] >= '0' && list[pos] <= '9'; ++pos) {
+        value = value * 10 + (list[pos] - '0');
+    }
+    return value;
+}
+
+template<size_t Count>
+constexpr std::array<Extent, Count> parse_extents(std::string_view list) {
+    std::array<Extent, Count> extents{};
+    size_t pos = 0;
+    for (auto& extent : extents) {
+        pos = list.find("S(", pos) + 2;
+        extent.rows = parse_extent_number(list, pos);
+        extent.cols = parse_extent_number(list, pos);
+    }
+    return extents;
+}
+
+inline constexpr auto static_extents = parse_extents<count_extents(SIZES)>(SIZES);
+
+// Map widths listed in WIDTHS as "cols,...". A map of one of these widths
+// and any height runs on an engine with that compile-time row stride.
+constexpr size_t count_widths(std::string_view list) {
+    size_t count = 0;
+    for (size_t pos = 0; pos < list.size();) {
+        if (list[pos] >= '0' && list[pos] <= '9') {
+            ++count;
+            parse_extent_number(list, pos);
+        } else {
+            ++pos;
+        }
+    }
+    return count;
+}
+
+template<size_t Count>
+constexpr std::array<size_t, Count> parse_widths(std::string_view list) {
+    std::array<size_t, Count> widths{};
+    size_t pos = 0;
+    for (auto& width : widths) {
+        width = parse_extent_number(list, pos);
+    }
+    return widths;
+}
+
+inline constexpr auto static_widths = parse_widths<count_widths(WIDTHS)>(WIDTHS);
+
+enum class ExtentMode {
+    Auto,     // static engine if the map size is listed in SIZES, else
+              // width engine if its width is listed in WIDTHS; always
+              // the dynamic engine with SPARSE_STORAGE
+    Dynamic,  // always the dynamic engine
+    Static,   // static engine, error if the map size is not listed
+    Width     // width engine, error if the map width is not listed
+};
+
+template<typename PType, typename VType, typename VFType, size_t I = 0>
+std::unique_ptr<FluidSimulatorBase> create_static_simulator(
+    const std::vector<std::string>& field_data_input, size_t rows, size_t cols) {
+    if constexpr (I >= static_extents.size()) {
+        return nullptr;
+    } else {
+        constexpr Extent extent = static_extents[I];
+        if constexpr (extent.rows > 0 && extent.cols > 0) {
+            if (extent.rows == rows && extent.cols == cols) {
+                return SimulatorFactory::create<PType, VType, VFType, extent.rows, extent.cols>(field_data_input);
+            }
+        }
+        return create_static_simulator<PType, VType, VFType, I + 1>(field_data_input, rows, cols);
+    }
+}
+
+template<typename PType, typename VType, typename VFType, size_t I = 0>
+std::unique_ptr<FluidSimulatorBase> create_width_simulator(
+    const std::vector<std::string>& field_data_input, size_t cols) {
+    if constexpr (I >= static_widths.size()) {
+        return nullptr;
+    } else {
+        constexpr size_t width = static_widths[I];
+        if constexpr (width > 0) {
+            if (width == cols) {
+                return SimulatorFactory::create<PType, VType, VFType, 0, width>(field_data_input);
+            }
+        }
+        return create_width_simulator<PType, VType, VFType, I + 1>(field_data_input, cols);
+    }
+}
+
 inline std::unique_ptr<FluidSimulatorBase> createSimulatorInstance(
     const std::vector<std::string>& field_data_input,
     const char* p_type_str,
     const char* v_type_str,
-    const char* vf_type_str
+    const char* vf_type_str,
+    ExtentMode extent_mode = ExtentMode::Auto
 ) {
     try {
         auto p_info = parse_type_info(p_type_str);
@@ -111,9 +235,119 @@ inline std::unique_ptr<FluidSimulatorBase> createSimulatorInstance(
         static_assert(is_valid_simulator_type<VType>::value, "Invalid velocity type");
         static_assert(is_valid_simulator_type<VFType>::value, "Invalid velocity field type");
 
-        return std::make_unique<FluidSimulator<PType, VType, VFType>>(field_data_input);
+#ifdef SPARSE_STORAGE
+        // Static and width engines store every cell, walls included, so
+        // only the dynamic engine is block-sparse; asking for the others
+        // explicitly still gets them.
+        if (extent_mode == ExtentMode::Auto) {
+            extent_mode = ExtentMode::Dynamic;
+        }
+#endif
+        if (extent_mode != ExtentMode::Dynamic && !field_data_input.empty()) {
+            size_t rows = 0, cols = 0;
+            std::stringstream(field_data_input[0]) >> rows >> cols;
+            if (extent_mode != ExtentMode::Width) {
+                auto simulator = create_static_simulator<PType, VType, VFType>(field_data_input, rows, cols);
+                if (simulator) {
+                    return simulator;
+                }
+            }
+            if (extent_mode == ExtentMode::Static) {
+                throw std::runtime_error("No static extent for a " + std::to_string(rows) + "x" +
+                                         std::to_string(cols) + " map in SIZES");
+            }
+            auto simulator = create_width_simulator<PType, VType, VFType>(field_data_input, cols);
+            if (simulator) {
+                return simulator;
+            }
+            if (extent_mode == ExtentMode::Width) {
+                throw std::runtime_error("No width " + std::to_string(cols) + " in WIDTHS");
+            }
+        }
+
+        return SimulatorFactory::create<PType, VType, VFType>(field_data_input);
+    }
+    catch (const std::exception& e) {
+        throw std::runtime_error(std::string("Failed to create simulator: ") + e.what());
+    }
+}
+
+// The reference run of --storage-error: the same types on the dynamic
+// engine, with every field stored at full width.
+inline std::unique_ptr<FluidSimulatorBase> createFullWidthInstance(
+    const std::vector<std::string>& field_data_input,
+    const char* p_type_str,
+    const char* v_type_str,
+    const char* vf_type_str
+) {
+    try {
+        auto p_info = parse_type_info(p_type_str);
+        auto v_info = parse_type_info(v_type_str);
+        auto vf_info = parse_type_info(vf_type_str);
+
+        using PType = std::remove_cvref_t<decltype(find_matching_type<SupportedTypes>(p_info))>;
+        using VType = std::remove_cvref_t<decltype(find_matching_type<SupportedTypes>(v_info))>;
+        using VFType = std::remove_cvref_t<decltype(find_matching_type<SupportedTypes>(vf_info))>;
+
+        return SimulatorFactory::create_full_width<PType, VType, VFType>(field_data_input);
     }
     catch (const std::exception& e) {
         throw std::runtime_error(std::string("Failed to create simulator: ") + e.what());
     }
-}
\ No newline at end of file
+}
+
+// Each embedded map is parsed at compile time into a Scenario and runs on
+// the engine of its own extent.
+template<typename PType, typename VType, typename VFType, size_t I = 0>
+std::unique_ptr<FluidSimulatorBase> create_scenario_simulator(std::string_view name) {
+    if constexpr (I >= embedded_maps.size()) {
+        return nullptr;
+    } else {
+        constexpr ScenarioExtent extent = scenario_extent(embedded_maps[I].text);
+        static constexpr auto scenario = parse_scenario<extent.rows, extent.cols>(embedded_maps[I].text);
+        if (embedded_maps[I].name == name) {
+            return std::make_unique<FluidSimulator<PType, VType, VFType, extent.rows, extent.cols>>(scenario);
+        }
+        return create_scenario_simulator<PType, VType, VFType, I + 1>(name);
+    }
+}
+
+inline std::vector<std::string> embedded_map_lines(std::string_view name) {
+    for (const auto& map : embedded_maps) {
+        if (map.name != name) continue;
+        std::vector<std::string> lines;
+        std::stringstream ss{std::string(map.text)};
+        std::string line;
+        while (std::getline(ss, line)) {
+            lines.push_back(line);
+        }
+        return lines;
+    }
+    throw std::runtime_error("No embedded scenario named " + std::string(name));
+}
+
+inline std::unique_ptr<FluidSimulatorBase> createScenarioInstance(
+    const char* name,
+    const char* p_type_str,
+    const char* v_type_str,
+    const char* vf_type_str
+) {
+    try {
+        auto p_info = parse_type_info(p_type_str);
+        auto v_info = parse_type_info(v_type_str);
+        auto vf_info = parse_type_info(vf_type_str);
+
+        using PType = std::remove_cvref_t<decltype(find_matching_type<SupportedTypes>(p_info))>;
+        using VType = std::remove_cvref_t<decltype(find_matching_type<SupportedTypes>(v_info))>;
+        using VFType = std::remove_cvref_t<decltype(find_matching_type<SupportedTypes>(vf_info))>;
+
+        auto simulator = create_scenario_simulator<PType, VType, VFType>(name);
+        if (!simulator) {
+            throw std::runtime_error(std::string("No embedded scenario named ") + name);
+        }
+        return simulator;
+    }
+    catch (const std::exception& e) {
+        throw std::runtime_error(std::string("Failed to create simulator: ") + e.what());
+    }
+}
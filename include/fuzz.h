@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fuzz {
+    // What simulating a map cost: the mean time of a tick, and the most
+    // flow sweeps and the deepest move chain of any tick.
+    struct Score {
+        double tick_ms{0};
+        size_t flow_sweeps{0};
+        size_t move_depth{0};
+        bool depth_limit_hit{false};
+    };
+
+    // The measures the search maximises; each keeps its own worst map.
+    enum class Objective { TickTime, FlowSweeps, MoveDepth };
+    constexpr size_t OBJECTIVES = 3;
+
+    // A copy of a map file (as read by readFieldFromFile) with one random
+    // change: walls added or removed, a patch of material placed, two cells
+    // swapped, gravity scaled, or one density scaled. The size of the map
+    // and its outer border are kept.
+    std::vector<std::string> mutateMap(const std::vector<std::string>& map, std::mt19937& rnd);
+
+    // Hill climbing from `seed`: every iteration mutates the current worst
+    // map of one objective, in turn, and keeps the result for each
+    // objective it makes worse. `evaluate` simulates a map and measures it;
+    // it may throw for a map the engine rejects, which is then dropped.
+    // The worst maps are written to `corpus_dir` as they are found, one
+    // file per objective, with corpus.lst listing them for --pack.
+    std::vector<Score> search(const std::vector<std::string>& seed, size_t iterations,
+                              const std::string& corpus_dir, unsigned seed_value,
+                              const std::function<Score(const std::vector<std::string>&)>& evaluate);
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <type_traits>
+#include <cstddef>
+#include <cassert>
+#ifdef SPARSE_STORAGE
+#include "block_sparse.h"
+#endif
+
+// Row-major 2D array in one allocation. grid[x] returns a pointer to row
+// x, so grid[x][y] indexes like a vector of rows, and the address of any
+// cell, including its neighbours, is a fixed offset from any other.
+template<typename T>
+class Grid {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    static constexpr bool contiguous = true;
+
+    Grid() = default;
+
+    void init(size_type rows, size_type cols, const T& value = T()) {
+        n_rows = rows;
+        n_cols = cols;
+        data.assign(rows * cols, value);
+    }
+
+    T* operator[](size_type x) {
+        assert(x < n_rows);
+        return data.data() + x * n_cols;
+    }
+
+    const T* operator[](size_type x) const {
+        assert(x < n_rows);
+        return data.data() + x * n_cols;
+    }
+
+    T* cell(size_type x, size_type y) { return data.data() + x * n_cols + y; }
+    const T* cell(size_type x, size_type y) const { return data.data() + x * n_cols + y; }
+
+    size_type rows() const { return n_rows; }
+    size_type cols() const { return n_cols; }
+    bool empty() const { return data.empty(); }
+    // Distance between vertically adjacent cells.
+    size_type stride() const { return n_cols; }
+
+private:
+    size_type n_rows{0}, n_cols{0};
+    std::vector<T> data;
+};
+
+// Grid with compile-time extents: the row stride is the constant K and the
+// cells live inside the object, so indexing needs no loads of the extents.
+// The map may be smaller than N x K; rows() and cols() report the size
+// passed to init().
+template<typename T, std::size_t N, std::size_t K>
+class StaticGrid {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    static constexpr bool contiguous = true;
+
+    StaticGrid() = default;
+
+    void init(size_type rows, size_type cols, const T& value = T()) {
+        assert(rows <= N && cols <= K);
+        n_rows = rows;
+        n_cols = cols;
+        data.fill(value);
+    }
+
+    T* operator[](size_type x) {
+        assert(x < N);
+        return data.data() + x * K;
+    }
+
+    const T* operator[](size_type x) const {
+        assert(x < N);
+        return data.data() + x * K;
+    }
+
+    T* cell(size_type x, size_type y) { return data.data() + x * K + y; }
+    const T* cell(size_type x, size_type y) const { return data.data() + x * K + y; }
+
+    size_type rows() const { return n_rows; }
+    size_type cols() const { return n_cols; }
+    bool empty() const { return n_rows == 0 || n_cols == 0; }
+    static constexpr size_type stride() { return K; }
+
+private:
+    size_type n_rows{0}, n_cols{0};
+    std::array<T, N * K> data{};
+};
+
+// Grid with a compile-time width and a run-time height: the row stride is
+// the constant K, while the rows live on the heap, so one engine serves
+// maps of any height with that width.
+template<typename T, std::size_t K>
+class WidthGrid {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    static constexpr bool contiguous = true;
+
+    WidthGrid() = default;
+
+    void init(size_type rows, size_type cols, const T& value = T()) {
+        assert(cols <= K);
+        n_rows = rows;
+        n_cols = cols;
+        data.assign(rows * K, value);
+    }
+
+    T* operator[](size_type x) {
+        assert(x < n_rows);
+        return data.data() + x * K;
+    }
+
+    const T* operator[](size_type x) const {
+        assert(x < n_rows);
+        return data.data() + x * K;
+    }
+
+    T* cell(size_type x, size_type y) { return data.data() + x * K + y; }
+    const T* cell(size_type x, size_type y) const { return data.data() + x * K + y; }
+
+    size_type rows() const { return n_rows; }
+    size_type cols() const { return n_cols; }
+    bool empty() const { return data.empty(); }
+    static constexpr size_type stride() { return K; }
+
+private:
+    size_type n_rows{0}, n_cols{0};
+    std::vector<T> data;
+};
+
+// Storage of the dynamic-extent engine: block-sparse with SPARSE_STORAGE,
+// so that all-wall regions of large maps take no memory.
+#ifdef SPARSE_STORAGE
+template<typename T>
+using DynamicGrid = BlockSparseGrid<T>;
+#else
+template<typename T>
+using DynamicGrid = Grid<T>;
+#endif
+
+// Static storage when both extents are known at compile time, a constant
+// stride when only the width K is.
+template<typename T, std::size_t N, std::size_t K>
+using ExtentGrid = std::conditional_t<(N > 0 && K > 0), StaticGrid<T, N, K>,
+                   std::conditional_t<(K > 0), WidthGrid<T, K>, DynamicGrid<T>>>;
@@ -0,0 +1,102 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+// A neighbourhood is a compile-time list of direction offsets. Kernels
+// visit it through for_each_direction / any_direction, which expand into
+// one call per direction with the index as a constant, so offsets fold
+// into the addressing instead of being looked up at run time.
+template<typename Derived, size_t D>
+struct Neighbourhood {
+    static constexpr size_t size = D;
+
+    template<size_t I>
+    static constexpr int dx = Derived::deltas[I].first;
+
+    template<size_t I>
+    static constexpr int dy = Derived::deltas[I].second;
+
+    // Displacement of direction I in a row-major array with the given row
+    // stride; constant when the stride is.
+    template<size_t I>
+    static constexpr std::ptrdiff_t offset(size_t stride) {
+        return static_cast<std::ptrdiff_t>(dx<I>) * static_cast<std::ptrdiff_t>(stride) + dy<I>;
+    }
+
+    // Index of the direction pointing back from the neighbour.
+    template<size_t I>
+    static constexpr size_t opposite = [] {
+        for (size_t j = 0; j < D; ++j) {
+            if (Derived::deltas[j].first == -dx<I> && Derived::deltas[j].second == -dy<I>) {
+                return j;
+            }
+        }
+        return D;
+    }();
+
+    // Every undirected edge has exactly one forward direction: down a row,
+    // or along the row to the right.
+    template<size_t I>
+    static constexpr bool forward = dx<I> > 0 || (dx<I> == 0 && dy<I> > 0);
+
+    template<size_t I>
+    static constexpr bool diagonal = dx<I> != 0 && dy<I> != 0;
+
+    static constexpr bool has_diagonals = [] {
+        for (auto [ddx, ddy] : Derived::deltas) {
+            if (ddx != 0 && ddy != 0) return true;
+        }
+        return false;
+    }();
+
+    static constexpr size_t index(int ddx, int ddy) {
+        for (size_t j = 0; j < D; ++j) {
+            if (Derived::deltas[j].first == ddx && Derived::deltas[j].second == ddy) {
+                return j;
+            }
+        }
+        return D;
+    }
+};
+
+// The four edge neighbours, in the order the simulator has always used.
+struct VonNeumann : Neighbourhood<VonNeumann, 4> {
+    static constexpr std::array<std::pair<int, int>, 4> deltas{{{-1, 0}, {1, 0}, {0, -1}, {0, 1}}};
+    // Flow sweeps run until nothing changes.
+    static constexpr double min_flow_gain = 0;
+};
+
+// The four edge neighbours followed by the four diagonal ones.
+struct Moore : Neighbourhood<Moore, 8> {
+    static constexpr std::array<std::pair<int, int>, 8> deltas{{
+        {-1, 0}, {1, 0}, {0, -1}, {0, 1}, {-1, -1}, {-1, 1}, {1, -1}, {1, 1}}};
+    // Diagonals close three-cell cycles. A path that enters one below a
+    // nearly full edge pushes only that edge's residual around the cycle,
+    // and the next sweep does the same, so filling the cycle can take
+    // 10^5 sweeps. A tick's flow ends at the first sweep routing less.
+    static constexpr double min_flow_gain = 1e-6;
+};
+
+// Calls f(std::integral_constant<size_t, I>{}) for every direction I in
+// order.
+template<typename Hood, typename F>
+constexpr void for_each_direction(F&& f) {
+    [&]<size_t... I>(std::index_sequence<I...>) {
+        (f(std::integral_constant<size_t, I>{}), ...);
+    }(std::make_index_sequence<Hood::size>{});
+}
+
+// Like for_each_direction, but stops after the first call returning true
+// and returns whether one did.
+template<typename Hood, typename F>
+constexpr bool any_direction(F&& f) {
+    return [&]<size_t... I>(std::index_sequence<I...>) {
+        return (f(std::integral_constant<size_t, I>{}) || ...);
+    }(std::make_index_sequence<Hood::size>{});
+}
+
+#ifndef NEIGHBOURHOOD
+#define NEIGHBOURHOOD VonNeumann
+#endif
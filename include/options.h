@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Runtime switches of a simulation run. Defaults give the fastest mode;
+// compatibility switches reproduce the results of earlier versions.
+struct SimulatorOptions {
+    // Draw a random number for every unvisited cell of the move sweep, as
+    // the full-grid sweep did, instead of only for move candidates. Cells
+    // are stopped in the same order either way; only the stream differs.
+    bool compat_rng{false};
+
+    // Bounded flow: stop a tick's flow sweeps after this many sweeps, or
+    // once a sweep routes less than min_flow_gain. Zero means exact.
+    size_t max_flow_sweeps{0};
+    double min_flow_gain{0};
+    // Finish the flow of early-stopped ticks on a copy to report how much
+    // the bound left unrouted.
+    bool measure_flow_residual{false};
+
+    // Recompute velocities material by material (see
+    // recompute_velocities_grouped); same results, uniform inner loops.
+    bool material_order{false};
+
+    // Spread the stops of the move sweep as a bit-plane frontier (see
+    // propagate_stop_frontier) instead of recursively; same results.
+    bool frontier_stop{false};
+
+    // Per-tick analytics (see analytics.h) written to stats_path every
+    // stats_interval ticks, as CSV or binary; empty path disables them.
+    std::string stats_path;
+    size_t stats_interval{1};
+    bool stats_binary{false};
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// A rectangle of a packed map holding one of the maps packed into it.
+struct PackedRegion {
+    size_t x0{0}, y0{0};
+    size_t rows{0}, cols{0};
+};
+
+namespace packing {
+    // Several maps tiled into one map file, each in its own region and
+    // separated from the others by walls. `sources` gives the index of each
+    // region's map in the list passed to packMaps.
+    struct Pack {
+        std::vector<std::string> field_data;
+        std::vector<PackedRegion> regions;
+        std::vector<size_t> sources;
+    };
+
+    // Packs map files (as read by readFieldFromFile) into as few packs as
+    // possible. Maps only share a pack if their gravity and densities are
+    // the same; regions are placed on shelves of at most `max_cols`
+    // columns.
+    std::vector<Pack> packMaps(const std::vector<std::vector<std::string>>& maps, size_t max_cols = 1024);
+
+    // The cells of region `region` of a packed layout.
+    std::vector<std::string> unpackLayout(const Pack& pack, size_t region,
+                                          const std::vector<std::string>& layout);
+}
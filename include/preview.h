@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace preview {
+    // Downsamples a field file by `factor` in both dimensions. A block
+    // becomes a wall if at least half of it is wall, otherwise it takes its
+    // most common open material. Walled blocks are then reopened where
+    // needed so that each connected region of the map stays connected.
+    // The coarse map has a ring of wall blocks around the downsampled
+    // one, so cells at the edge of the map are kept. Gravity is divided by `factor`
+    // and densities multiplied by `factor * factor`, which keeps the
+    // hydrostatic pressure of a column the same as at full resolution.
+    std::vector<std::string> downsampleField(const std::vector<std::string>& field_data, size_t factor);
+
+    // Builds a full-resolution field file from the original input with the
+    // materials of the coarse final layout (as from downsampleField, with
+    // its wall ring) painted into its open cells.
+    std::vector<std::string> upsampleField(const std::vector<std::string>& field_data,
+                                           const std::vector<std::string>& coarse_layout,
+                                           size_t factor);
+
+    // Prints, per material, how many full-resolution cells it occupies and
+    // where it ended up, for the coarse final layout.
+    void printReport(std::ostream& out,
+                     const std::vector<std::string>& field_data,
+                     const std::vector<std::string>& coarse_layout,
+                     size_t factor);
+}
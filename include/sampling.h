@@ -0,0 +1,63 @@
+#pragma once
+#include <array>
+#include <cstddef>
+
+#ifndef BRANCHY_SAMPLING
+
+// Prefix sums of the weights whose mask is set, the others contributing
+// zero. Selecting instead of branching keeps the loop free of
+// data-dependent jumps, and the result is non-decreasing.
+template<typename T, size_t D>
+std::array<T, D> masked_prefix_sums(const std::array<T, D>& weights, const std::array<bool, D>& mask) {
+    std::array<T, D> prefix{};
+    T sum = T(0);
+    for (size_t i = 0; i < D; ++i) {
+        sum += mask[i] ? weights[i] : T(0);
+        prefix[i] = sum;
+    }
+    return prefix;
+}
+
+// Index of the first threshold above r, found by counting the thresholds
+// at or below it. Thresholds must be non-decreasing. If r is not below the
+// last threshold the first direction is returned, as the linear scan did.
+template<typename T, size_t D>
+size_t sample_direction(const std::array<T, D>& thresholds, T r) {
+    size_t count = 0;
+    for (size_t i = 0; i < D; ++i) {
+        count += static_cast<size_t>(thresholds[i] <= r);
+    }
+    return count < D ? count : 0;
+}
+
+#else
+
+// The scans the helpers above replaced, with a conditional skip and an
+// early exit; they choose the same directions. Only built to compare
+// branch misses against (see bench_sampling).
+template<typename T, size_t D>
+std::array<T, D> masked_prefix_sums(const std::array<T, D>& weights, const std::array<bool, D>& mask) {
+    std::array<T, D> prefix{};
+    T sum = T(0);
+    for (size_t i = 0; i < D; ++i) {
+        if (!mask[i]) {
+            prefix[i] = sum;
+            continue;
+        }
+        sum += weights[i];
+        prefix[i] = sum;
+    }
+    return prefix;
+}
+
+template<typename T, size_t D>
+size_t sample_direction(const std::array<T, D>& thresholds, T r) {
+    for (size_t i = 0; i < D; ++i) {
+        if (thresholds[i] > r) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+#endif
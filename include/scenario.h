@@ -0,0 +1,141 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <stdexcept>
+#include "neighbourhood.h"
+
+// Maps parsed at compile time. The text has the layout of a map file: a
+// "rows cols" line, the gravity, the rows of cells and "c = rho" lines.
+// The walls, the open-cell list, the open-neighbour counts and the density
+// table come out as constexpr arrays, so an engine built from a Scenario
+// starts without parsing anything.
+
+struct ScenarioExtent {
+    size_t rows{0};
+    size_t cols{0};
+};
+
+namespace scenario_detail {
+
+constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+constexpr std::string_view next_line(std::string_view text, size_t& pos) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string_view::npos) end = text.size();
+    std::string_view line = text.substr(pos, end - pos);
+    pos = end < text.size() ? end + 1 : end;
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return line;
+}
+
+constexpr size_t parse_size(std::string_view line, size_t& pos) {
+    while (pos < line.size() && !is_digit(line[pos])) ++pos;
+    if (pos == line.size()) throw std::invalid_argument("expected a number");
+    size_t value = 0;
+    for (; pos < line.size() && is_digit(line[pos]); ++pos) {
+        value = value * 10 + (line[pos] - '0');
+    }
+    return value;
+}
+
+// Decimal numbers of the form [-]digits[.digits]. The digits are gathered
+// into an integer and divided by a power of ten once, which rounds the
+// same way as strtod while the digits fit in a double's mantissa.
+constexpr double parse_number(std::string_view text) {
+    size_t pos = 0;
+    while (pos < text.size() && text[pos] == ' ') ++pos;
+    bool negative = pos < text.size() && text[pos] == '-';
+    if (negative) ++pos;
+    unsigned long long mantissa = 0;
+    double scale = 1;
+    bool fraction = false, any = false;
+    for (; pos < text.size(); ++pos) {
+        if (text[pos] == '.' && !fraction) {
+            fraction = true;
+        } else if (is_digit(text[pos])) {
+            mantissa = mantissa * 10 + (text[pos] - '0');
+            if (fraction) scale *= 10;
+            any = true;
+        } else {
+            break;
+        }
+    }
+    if (!any) throw std::invalid_argument("expected a number");
+    double value = static_cast<double>(mantissa) / scale;
+    return negative ? -value : value;
+}
+
+} // namespace scenario_detail
+
+constexpr ScenarioExtent scenario_extent(std::string_view text) {
+    size_t pos = 0;
+    std::string_view header = scenario_detail::next_line(text, pos);
+    size_t col = 0;
+    ScenarioExtent extent;
+    extent.rows = scenario_detail::parse_size(header, col);
+    extent.cols = scenario_detail::parse_size(header, col);
+    return extent;
+}
+
+template<size_t Rows, size_t Cols>
+struct Scenario {
+    static constexpr size_t rows = Rows;
+    static constexpr size_t cols = Cols;
+    static constexpr double default_rho = 0.01;
+
+    double g{0};
+    std::array<char, Rows * Cols> types{};
+    std::array<bool, Rows * Cols> walls{};
+    // Number of open neighbours of each open cell in the neighbourhood the
+    // scenario was parsed for.
+    std::array<int, Rows * Cols> dirs{};
+    // Linear indices of the open cells in row-major order.
+    std::array<size_t, Rows * Cols> open_cells{};
+    size_t open_count{0};
+    std::array<double, 256> rho{};
+};
+
+template<size_t Rows, size_t Cols, typename Hood = NEIGHBOURHOOD>
+constexpr Scenario<Rows, Cols> parse_scenario(std::string_view text) {
+    using namespace scenario_detail;
+    Scenario<Rows, Cols> scenario;
+    size_t pos = 0;
+    next_line(text, pos);
+    scenario.g = parse_number(next_line(text, pos));
+
+    for (size_t x = 0; x < Rows; ++x) {
+        std::string_view line = next_line(text, pos);
+        if (line.size() < Cols) throw std::invalid_argument("map row too short");
+        for (size_t y = 0; y < Cols; ++y) {
+            scenario.types[x * Cols + y] = line[y];
+            scenario.walls[x * Cols + y] = line[y] == '#';
+        }
+    }
+
+    for (size_t x = 0; x < Rows; ++x) {
+        for (size_t y = 0; y < Cols; ++y) {
+            if (scenario.walls[x * Cols + y]) continue;
+            scenario.open_cells[scenario.open_count++] = x * Cols + y;
+            int count = 0;
+            for (auto [dx, dy] : Hood::deltas) {
+                size_t nx = x + dx, ny = y + dy;
+                count += nx < Rows && ny < Cols && !scenario.walls[nx * Cols + ny];
+            }
+            scenario.dirs[x * Cols + y] = count;
+        }
+    }
+
+    for (double& rho : scenario.rho) {
+        rho = Scenario<Rows, Cols>::default_rho;
+    }
+    while (pos < text.size()) {
+        std::string_view line = next_line(text, pos);
+        size_t start = line.find_first_not_of(' ');
+        if (start == std::string_view::npos) continue;
+        size_t equals = line.find('=', start);
+        if (equals == std::string_view::npos) continue;
+        scenario.rho[static_cast<unsigned char>(line[start])] = parse_number(line.substr(equals + 1));
+    }
+    return scenario;
+}
@@ -8,128 +8,396 @@
 #include <algorithm>
 #include <cassert>
 #include <tuple>
+#include <memory>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
 #include "fixed.h"
 #include "vector_field.h"
+#include "storage.h"
+#include "options.h"
+#include "bit_plane.h"
+#include "sampling.h"
+#include "grid.h"
+#include "neighbourhood.h"
+#include "scenario.h"
+#include "analytics.h"
+#include "packing.h"
+
+// The contents of a cell (material and pressure) moving from one cell to
+// another, as linear indices x * cols + y. Every change of a cell's
+// material comes from a move.
+struct MoveEvent {
+    uint32_t from;
+    uint32_t to;
+};
+
+// Pressures and velocities of every cell, widened to double, in
+// row-major order with the velocities of a cell in deltas order.
+struct FieldValues {
+    std::vector<double> pressure;
+    std::vector<double> velocity;
+};
+
+// Work done by one tick, for telling which maps are slow to simulate.
+struct TickCost {
+    size_t flow_sweeps{0};
+    // Longest move chain, in cells after the first; chains are cut at the
+    // recursion limit of propagate_move, which sets depth_limit_hit.
+    size_t move_depth{0};
+    bool depth_limit_hit{false};
+};
 
 class FluidSimulatorBase {
 public:
     virtual ~FluidSimulatorBase() = default;
+    void set_options(const SimulatorOptions& new_options) { options = new_options; }
     virtual void run(size_t steps, size_t checkpoint_interval) = 0;
+    // Advances the simulation by one tick; returns whether anything moved.
+    virtual bool tick() = 0;
+    // FNV-1a hash of the cell types, pressures, velocities and the visit
+    // generation, for comparing engines tick by tick.
+    virtual uint64_t state_hash() const = 0;
+    // The state as plain numbers, for comparing runs whose fields are
+    // stored with different precision.
+    virtual FieldValues field_values() const = 0;
     virtual void load_state(const char* filename) = 0;
     virtual void save_state(const char* filename) = 0;
+    virtual std::vector<std::string> layout() const = 0;
+    // Writes the frame run() prints after a tick in which something moved.
+    virtual void print_frame(std::ostream& out, size_t tick) const = 0;
+    // Declares the map a pack of independent maps (see packing.h): each
+    // region draws from its own random stream, seeded like a fresh
+    // simulator, so it evolves exactly as if it ran alone.
+    virtual void set_regions(const std::vector<PackedRegion>& regions) = 0;
+    // Whether each region passed a move test in the last tick, i.e. what
+    // tick() would have returned had it run alone.
+    virtual const std::vector<char>& region_moved() const = 0;
+    // Moves of the last tick in the order they took effect, so that
+    // consumers can follow changes without comparing whole grids. The
+    // buffer is reused by the next tick.
+    virtual const std::vector<MoveEvent>& move_events() const = 0;
+    virtual const TickCost& last_tick_cost() const = 0;
+
+protected:
+    SimulatorOptions options;
 };
 
-template<typename PType, typename VType, typename VFType, size_t N = 0, size_t K = 0>
+// Hood is the neighbourhood (see neighbourhood.h); every per-direction
+// loop is expanded over it at compile time. Formats are the storage
+// formats of the fields (see storage.h).
+template<typename PType, typename VType, typename VFType, size_t N = 0, size_t K = 0,
+         typename Hood = NEIGHBOURHOOD, typename Formats = ConfiguredStorage>
 class FluidSimulator : public FluidSimulatorBase {
 public:
     explicit FluidSimulator(const std::vector<std::string>& field_data_input);
+    // Starts from a map parsed at compile time; N x K is its extent.
+    template<size_t R, size_t C>
+    explicit FluidSimulator(const Scenario<R, C>& scenario);
     void run(size_t steps, size_t checkpoint_interval) override;
+    bool tick() override;
+    uint64_t state_hash() const override;
+    FieldValues field_values() const override;
     void load_state(const char* filename) override;
     void save_state(const char* filename) override;
+    std::vector<std::string> layout() const override;
+    void print_frame(std::ostream& out, size_t tick) const override;
+    void set_regions(const std::vector<PackedRegion>& new_regions) override;
+    const std::vector<char>& region_moved() const override { return moved_regions; }
+    const std::vector<MoveEvent>& move_events() const override { return move_log; }
+    const TickCost& last_tick_cost() const override { return tick_cost; }
 
 private:
-    struct ParticleParams {
-        char type;
-        PType cur_p;
-        std::array<VFType, 4> v;
-
-        void swap_with(FluidSimulator* sim, size_t x, size_t y) {
-            if (sim->use_static) {
-                std::swap(sim->field[x][y], type);
-                std::swap(sim->static_p[x][y], cur_p);
-                v = sim->static_velocity.get_array(x, y);
-                sim->static_velocity.set_array(x, y, v);
-            } else {
-                std::swap(sim->field_data[x][y], type);
-                std::swap(sim->p[x][y], cur_p);
-                v = sim->velocity.get_array(x, y);
-                sim->velocity.set_array(x, y, v);
-            }
-        }
-    };
-
+    using PStore = Stored<PType, typename Formats::Pressure, PressureTag>;
+    using VStore = Stored<VFType, typename Formats::Velocity, VelocityTag>;
+    using VFStore = Stored<VFType, typename Formats::Flow, VelocityFlowTag>;
+    static constexpr size_t D = Hood::size;
+    static constexpr auto deltas = Hood::deltas;
+
+    // With N and K both non-zero the per-cell fields use static storage of
+    // N x K cells with a constant row stride; the kernels are the same.
     std::vector<std::string> field_data;
-    std::vector<std::vector<PType>> p;
-    std::vector<std::vector<PType>> old_p;
-
-    VectorField<VFType> velocity;
-    VectorField<VFType> velocity_flow;
-    std::vector<std::vector<int>> last_use;
+    ExtentGrid<PStore, N, K> p;
+    ExtentGrid<PStore, N, K> old_p;
+
+    ExtentVelocityField<VStore, N, K, D> velocity;
+    ExtentVelocityField<VFStore, N, K, D> velocity_flow;
+    ExtentGrid<int, N, K> last_use;
+    // Number of open neighbours of every open cell, from count_dirs().
+    ExtentGrid<int, N, K> dirs;
+#ifdef SPARSE_STORAGE
+    // Blocks of the map holding open cells, shared by every block-sparse
+    // field; rebuilt by allocate_fields().
+    std::shared_ptr<const BlockLayout> block_layout;
+#endif
+    // Bit planes of walls and of cells with last_use == UT, kept in sync
+    // by set_last_use() and next_generation().
+    BitPlane wall_plane;
+    BitPlane open_plane;
+    BitPlane visited_plane;
+    // With options.frontier_stop: cells with a positive velocity in each
+    // direction, set by update_move_weights, and the frontier planes of
+    // propagate_stop_frontier. Allocated by the first tick that uses them.
+    std::array<BitPlane, D> positive_planes;
+    BitPlane stop_frontier;
+    BitPlane stop_next;
+
+    // Per-cell prefix sums of the positive velocities towards open
+    // neighbours, in deltas order, and their total in PType. Rebuilt for a
+    // cell as soon as its velocities are final for the tick, so the move
+    // sweep only recomputes them for cells next to visited cells.
+    struct MoveWeights {
+        std::array<VFType, D> thresholds{};
+        PType sum{0};
+    };
+    ExtentGrid<MoveWeights, N, K> move_weights;
+    // Linear indices of cells with a positive move weight, in row-major
+    // order; collected by update_move_weights.
+    std::vector<size_t> move_candidates;
+    // Cells the flow sweeps start from, in row-major order; see
+    // collect_flow_seeds.
+    std::vector<size_t> flow_seeds;
+
+    // Swaps of a move chain, recorded by propagate_move in the order they
+    // take effect and applied together once the chain is complete.
+    std::vector<std::pair<size_t, size_t>> pending_swaps;
+    std::vector<size_t> move_cells;
+    std::vector<size_t> move_sources;
+    std::vector<char> move_types;
+    std::vector<PStore> move_pressures;
+    // Moves of the current tick. Cleared rather than freed between ticks,
+    // so it stops allocating once it has held the busiest tick's moves.
+    std::vector<MoveEvent> move_log;
+
+    // Linear indices of the open cells of each material, in no particular
+    // order, and every open cell's position in its list. Built by the first
+    // grouped recompute and then kept up to date by apply_pending_moves.
+    // Like recompute_forces, the slots are only allocated when used, so
+    // they are dynamic grids in every engine.
+    std::array<std::vector<size_t>, 256> material_cells;
+    DynamicGrid<uint32_t> material_slot;
+    bool material_lists_valid{false};
+
+    // Forces of the grouped and the edge-major recompute, per cell and
+    // direction, with a bit per direction whose velocity was positive.
+    // Allocated by the first recompute that uses them.
+    using RecomputeForce = decltype((std::declval<VStore&>() - std::declval<VFStore&>()) * std::declval<PType>());
+    struct CellForces {
+        std::array<RecomputeForce, D> force{};
+        uint32_t mask{0};
+    };
+    DynamicGrid<CellForces> recompute_forces;
+    bool recompute_forces_valid{false};
 
     std::mt19937 rnd;
+    // Stream random01 draws from: rnd, or in a packed run the stream of the
+    // region whose cell the move sweep is visiting.
+    std::mt19937* active_rnd{&rnd};
+    std::vector<std::mt19937> region_rnd;
+    std::vector<uint32_t> cell_region;
+    std::vector<char> moved_regions;
+    std::vector<PackedRegion> regions;
+    // Regions whose last flow sweep made progress; a sweep of a region
+    // that made none changes nothing, so later sweeps skip it.
+    std::vector<char> flowing_regions;
+    std::vector<char> region_progress;
 
     size_t rows{0}, cols{0};
     size_t UT{0};
-    std::array<std::pair<int, int>, 4> deltas{{{-1, 0}, {1, 0}, {0, -1}, {0, 1}}};
+    size_t ticks{0};
+
+    // Opened on the first tick when options.stats_path is set; the totals
+    // are gathered by the gravity pass of apply_forces.
+    std::unique_ptr<analytics::StatsWriter> stats_writer;
+    analytics::FieldStats tick_stats;
+    size_t stats_outlet_row{0};
+    size_t flow_updates{0};
+
+    struct FlowStats {
+        size_t sweeps{0};
+        // Ticks whose last allowed sweep still made progress; with
+        // measure_flow_residual, those whose flow really was left short.
+        size_t stopped_ticks{0};
+        size_t capped_ticks{0};
+        double routed{0};
+        double residual{0};
+        // Largest difference between the bounded and the exact flow of an
+        // edge, and how many edge flows differed, over all capped ticks.
+        // The flow becomes the velocity, so this is the effect on the
+        // state the tick leaves.
+        double max_edge_gap{0};
+        size_t gap_edges{0};
+    } flow_stats;
+    TickCost tick_cost;
     std::vector<PType> rho;
     PType g{0};
 
-    std::array<std::array<char, K + 1>, N> field{};
-    std::array<std::array<PType, K>, N> static_p{};
-    std::array<std::array<PType, K>, N> static_old_p{};
-    StaticVectorField<VFType, N, K> static_velocity;
-    StaticVectorField<VFType, N, K> static_velocity_flow;
-    std::array<std::array<int, K>, N> static_last_use{};
-    bool use_static{N > 0 && K > 0};
+    // Number of columns; a constant on engines with only a compile-time
+    // width, which always run maps of exactly that width, so row loops
+    // bounded by it get constant trip counts.
+    size_t width() const {
+        if constexpr (N == 0 && K > 0) {
+            return K;
+        } else {
+            return cols;
+        }
+    }
 
     void initialize_field();
+    void allocate_fields();
+    void print_state();
+    void build_planes();
+    void count_dirs();
+    void set_last_use(size_t x, size_t y, size_t value) {
+        last_use[x][y] = value;
+        visited_plane.assign(x, y, value == UT);
+    }
+    void next_generation() {
+        UT += 2;
+        visited_plane.clear();
+    }
     PType random01() noexcept;
+    // Selects the random stream of the region holding (x, y) and returns
+    // the region; a no-op without regions.
+    size_t enter_region(size_t x, size_t y) {
+        if (region_rnd.empty()) {
+            return 0;
+        }
+        size_t region = cell_region[x * cols + y];
+        active_rnd = &region_rnd[region];
+        return region;
+    }
 
     std::tuple<PType, bool, std::pair<int, int>>
     propagate_flow(int x, int y, PType lim);
     void propagate_stop(int x, int y, bool force = false);
+    void propagate_stop_frontier(size_t x, size_t y);
+    std::pair<PType, bool> flow_sweep();
+    double flow_residual();
+    void collect_flow_seeds();
+    // Whether flow can still leave (x, y) along some edge; capacity only
+    // shrinks during a tick's sweeps, so once false it stays false.
+    bool has_residual(size_t x, size_t y) {
+        return any_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+            size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+            if (nx >= rows || ny >= cols || field_data[nx][ny] == '#') {
+                return false;
+            }
+            auto cap = velocity.at(x, y, I);
+            auto flow = velocity_flow.at(x, y, I);
+            return !(flow >= cap);
+        });
+    }
+    void recompute_velocities(PType& total_delta_p);
+    void recompute_velocities_grouped(PType& total_delta_p);
+#ifdef EDGE_VELOCITY
+    void recompute_velocities_edges(PType& total_delta_p);
+#endif
+    void apply_recompute_forces(PType& total_delta_p);
+    void build_material_lists();
+    void move_material(size_t cell, char from, char to);
+    void add_flow(size_t x, size_t y, size_t dir, VFType dv) {
+        // The flow saturates at the capacity of its edge, so rounding of
+        // the sum never leaves it above. Narrow storage can also swallow a
+        // small increment; only count stores that change the field so the
+        // flow sweeps terminate.
+        VFType before = velocity_flow.at(x, y, dir);
+        VFType cap = velocity.at(x, y, dir);
+        velocity_flow.at(x, y, dir) = VFStore(std::min(before + dv, cap));
+        if (VFType(velocity_flow.at(x, y, dir)) != before) {
+            ++flow_updates;
+        }
+    }
     PType move_prob(int x, int y);
+    void apply_pending_moves();
+    void update_move_weights(size_t x, size_t y);
+    bool has_visited_neighbour(size_t x, size_t y) const {
+        if (x == 0 || y == 0 || x + 1 >= rows || y + 1 >= cols) {
+            return true;
+        }
+        if constexpr (decltype(last_use)::contiguous) {
+            const int* cell = last_use.cell(x, y);
+            return any_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                return cell[Hood::template offset<I>(last_use.stride())] == UT;
+            });
+        } else {
+            return any_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                return last_use[x + Hood::template dx<I>][y + Hood::template dy<I>] == UT;
+            });
+        }
+    }
+    template<size_t I>
+    PType exchange_pressure(size_t x, size_t y);
+    // Copies p into old_p for cells y0 .. y1 - 1 of row x; block-sparse
+    // rows are copied one block at a time.
+    void snapshot_pressure(size_t x, size_t y0, size_t y1) {
+        if constexpr (decltype(p)::contiguous) {
+            std::copy(p[x] + y0, p[x] + y1, old_p[x] + y0);
+        } else {
+            for (size_t y = y0; y < y1;) {
+                size_t end = std::min(y1, p.block_row_end(y));
+                std::copy(p.block_row(x, y), p.block_row(x, y) + (end - y), old_p.block_row(x, y));
+                y = end;
+            }
+        }
+    }
+    void apply_forces(PType& total_delta_p);
+    // Adds every open cell to tick_stats. Runs before apply_forces, whose
+    // banded pass changes a cell's upward and left velocities before it
+    // reaches the cell, so the totals describe the state the tick starts
+    // from.
+    void accumulate_stats() {
+        for (size_t x = 0; x < rows; ++x) {
+            for (size_t y = 0; y < cols; ++y) {
+                if (field_data[x][y] == '#') continue;
+                double v2 = 0;
+                for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                    double v = to_double(VFType(velocity.at(x, y, I)));
+                    v2 += v * v;
+                });
+                char type = field_data[x][y];
+                tick_stats.addCell(x, y, type, to_double(rho[(int) type]), v2, x == stats_outlet_row);
+            }
+        }
+    }
+
     bool propagate_move(int x, int y, bool is_first, int depth = 0) {
         const int MAX_DEPTH = 1000;
-        last_use[x][y] = UT - is_first;
+        set_last_use(x, y, UT - is_first);
         if (depth > MAX_DEPTH) {
             std::cerr << "Max recursion depth reached at (" << x << ", " << y << ")\n";
+            tick_cost.depth_limit_hit = true;
             return false;
         }
-
-        if (use_static) {
-            return static_propagate_move(x, y, is_first);
-        }
+        tick_cost.move_depth = std::max(tick_cost.move_depth, static_cast<size_t>(depth));
 
         bool ret = false;
         int target_x = -1, target_y = -1;
         do {
-            std::array<VFType, 4> thresholds{};
-            std::array<VFType, 4> velocities{};
-            VFType sum = VFType(0);
+            std::array<VFType, D> thresholds{};
 
-            for (size_t i = 0; i < deltas.size(); ++i) {
-                auto [dx, dy] = deltas[i];
-                int nx = x + dx, ny = y + dy;
-                if (nx >= static_cast<int>(rows) || ny >= static_cast<int>(cols) || nx < 0 || ny < 0) {
-                    continue;
-                }
-                if ((field_data[nx][ny] == '#' || last_use[nx][ny] == UT)) {
-                    velocities[i] = VFType(0);
-                    continue;
-                }
-                auto v = velocity.get(x, y, dx, dy, deltas);
-                if (v < 0) {
-                    thresholds[i] = sum;
-                    continue;
-                }
-                sum += v;
-                thresholds[i] = sum;
+            if (!has_visited_neighbour(x, y)) {
+                thresholds = move_weights[x][y].thresholds;
+            } else {
+                std::array<VFType, D> velocities{};
+                std::array<bool, D> mask{};
+                for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                    size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                    velocities[I] = velocity.at(x, y, I);
+                    mask[I] = nx < rows && ny < cols && field_data[nx][ny] != '#' &&
+                              last_use[nx][ny] != UT && velocities[I] > VFType(0);
+                });
+                thresholds = masked_prefix_sums(velocities, mask);
             }
+            VFType sum = thresholds[D - 1];
 
             if (sum == VFType(0)) {
                 break;
             }
 
             VFType r = random01() * sum;
-            size_t dir = 0;
-            for (size_t i = 0; i < thresholds.size(); i++) {
-                if (thresholds[i] > r) {
-                    dir = i;
-                    break;
-                }
-            }
-            
+            size_t dir = sample_direction(thresholds, r);
+
             auto [dx, dy] = deltas[dir];
 
             target_x = x + dx;
@@ -141,41 +409,32 @@ private:
 
             ret = (last_use[target_x][target_y] == UT - 1 || propagate_move(target_x, target_y, false, depth + 1));
         } while (!ret);
-        last_use[x][y] = UT;
-        for (size_t i = 0; i < deltas.size(); ++i) {
-            auto [dx, dy] = deltas[i];
-            int nx = x + dx, ny = y + dy;
-            if (nx > -1 && ny > -1 && nx < rows && ny < cols && (field_data[nx][ny] != '#' && last_use[nx][ny] < UT - 1 && velocity.get(x, y, dx, dy, deltas) < 0)) {
+        set_last_use(x, y, UT);
+        for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+            int nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+            if (nx > -1 && ny > -1 && nx < rows && ny < cols && (field_data[nx][ny] != '#' && last_use[nx][ny] < UT - 1 && velocity.at(x, y, I) < 0)) {
                 propagate_stop(nx, ny);
             }
+        });
+        if (ret && !is_first) {
+            pending_swaps.emplace_back(x * cols + y, target_x * cols + target_y);
         }
-        if (ret) {
-            if (!is_first) {
-                ParticleParams pp{};
-                pp.swap_with(this, x, y);
-                pp.swap_with(this, target_x, target_y);
-                pp.swap_with(this, x, y);
-            }
+        if (is_first) {
+            apply_pending_moves();
         }
         return ret;
     }
-
-    std::tuple<PType, bool, std::pair<size_t, size_t>>
-    static_propagate_flow(size_t x, size_t y, PType lim);
-    void static_propagate_stop(size_t x, size_t y, bool force = false);
-    PType static_move_prob(size_t x, size_t y);
-    bool static_propagate_move(size_t x, size_t y, bool is_first);
 };
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-FluidSimulator<PType, VType, VFType, N, K>::FluidSimulator(
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::FluidSimulator(
     const std::vector<std::string>& field_data_input)
     : field_data(field_data_input), rnd(1337) {
     initialize_field();
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-void FluidSimulator<PType, VType, VFType, N, K>::initialize_field() {
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::initialize_field() {
     std::cout << "Field data contains " << field_data.size() << " lines:\n";
     for (size_t i = 0; i < field_data.size(); i++) {
         std::cout << "Line " << i << ": " << field_data[i] << "\n";
@@ -192,6 +451,9 @@ void FluidSimulator<PType, VType, VFType, N, K>::initialize_field() {
     if (cols > K && K != 0) {
         throw std::runtime_error("Invalid cols");
     }
+    if (N == 0 && K != 0 && cols != K) {
+        throw std::runtime_error("Map width does not match the engine width");
+    }
     if (rows == 0 || cols == 0) {
         throw std::runtime_error("Invalid rows or cols");
     }
@@ -214,37 +476,91 @@ void FluidSimulator<PType, VType, VFType, N, K>::initialize_field() {
         }
     }
 
-    if (use_static) {
-        for (size_t x = 0; x < rows; ++x) {
-            for (size_t y = 0; y < cols; ++y) {
-                field[x][y] = field_lines[x][y];
+    field_data = field_lines; 
+    allocate_fields();
+    build_planes();
+    count_dirs();
+    print_state();
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+template<size_t R, size_t C>
+FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::FluidSimulator(const Scenario<R, C>& scenario)
+    : rnd(1337) {
+    static_assert(R == N && C == K, "a scenario runs on the engine of its own extent");
+    rows = R;
+    cols = C;
+    g = scenario.g;
+    rho.resize(256);
+    for (size_t i = 0; i < rho.size(); ++i) {
+        rho[i] = PType(scenario.rho[i]);
+    }
+    field_data.assign(rows, std::string(cols, ' '));
+    for (size_t x = 0; x < rows; ++x) {
+        field_data[x].assign(scenario.types.data() + x * cols, cols);
+    }
+    allocate_fields();
+
+    wall_plane.init(rows, cols);
+    open_plane.init(rows, cols);
+    visited_plane.init(rows, cols);
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (scenario.walls[x * cols + y]) {
+                wall_plane.set(x, y);
             }
         }
-    } else {
-        field_data = field_lines; 
-        p.resize(rows, std::vector<PType>(cols, PType(0)));
-        old_p.resize(rows, std::vector<PType>(cols, PType(0)));
-        velocity.init(rows, cols);
-        velocity_flow.init(rows, cols);
-        last_use.resize(rows, std::vector<int>(cols, 0));
     }
+    for (size_t i = 0; i < scenario.open_count; ++i) {
+        open_plane.set(scenario.open_cells[i] / cols, scenario.open_cells[i] % cols);
+    }
+    dirs.init(rows, cols, 0);
+    std::copy(scenario.dirs.begin(), scenario.dirs.end(), dirs[0]);
+    print_state();
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::allocate_fields() {
+#ifdef SPARSE_STORAGE
+    block_layout = std::make_shared<const BlockLayout>(BlockLayout::from_field(field_data, rows, cols));
+    auto share_layout = [&](auto& field) {
+        if constexpr (requires { field.set_layout(block_layout); }) {
+            field.set_layout(block_layout);
+        }
+    };
+    share_layout(p);
+    share_layout(old_p);
+    share_layout(velocity);
+    share_layout(velocity_flow);
+    share_layout(last_use);
+    share_layout(dirs);
+    share_layout(move_weights);
+    share_layout(material_slot);
+    share_layout(recompute_forces);
+#endif
+    p.init(rows, cols, PType(0));
+    old_p.init(rows, cols, PType(0));
+    velocity.init(rows, cols);
+    velocity_flow.init(rows, cols);
+    last_use.init(rows, cols, 0);
+    move_weights.init(rows, cols);
+    material_lists_valid = false;
+    recompute_forces_valid = false;
+    positive_planes.fill(BitPlane());
+    stop_frontier = BitPlane();
+    stop_next = BitPlane();
+    move_log.clear();
+}
 
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::print_state() {
     std::cout << "\n=== Current Simulator State ===\n";
     std::cout << "Dimensions: " << rows << "x" << cols << "\n";
     std::cout << "Gravity: " << g << "\n";
     
     std::cout << "\nField Layout:\n";
-    if (use_static) {
-        for (size_t x = 0; x < rows; ++x) {
-            for (size_t y = 0; y < cols; ++y) {
-                std::cout << field[x][y];
-            }
-            std::cout << "\n";
-        }
-    } else {
-        for (const auto& row : field_data) {
-            std::cout << row << "\n";
-        }
+    for (const auto& row : field_data) {
+        std::cout << row << "\n";
     }
 
     std::cout << "\nDensity Values:\n";
@@ -257,31 +573,70 @@ void FluidSimulator<PType, VType, VFType, N, K>::initialize_field() {
     std::cout << "\nCurrent Pressures:\n";
     for (size_t x = 0; x < rows; ++x) {
         for (size_t y = 0; y < cols; ++y) {
-            if (use_static) {
-                std::cout << static_p[x][y] << " ";
-            } else {
-                std::cout << p[x][y] << " ";
-            }
+            std::cout << p[x][y] << " ";
         }
         std::cout << "\n";
     }
     std::cout << "===========================\n\n";
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-PType FluidSimulator<PType, VType, VFType, N, K>::random01() noexcept {
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::build_planes() {
+    wall_plane.init(rows, cols);
+    open_plane.init(rows, cols);
+    visited_plane.init(rows, cols);
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (field_data[x][y] == '#') {
+                wall_plane.set(x, y);
+            } else {
+                open_plane.set(x, y);
+            }
+            if (last_use[x][y] == UT) {
+                visited_plane.set(x, y);
+            }
+        }
+    }
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::count_dirs() {
+    dirs.init(rows, cols, 0);
+    if constexpr (std::is_same_v<Hood, VonNeumann>) {
+        for (size_t x = 0; x < rows; ++x) {
+            for (size_t w = 0; w < open_plane.words_per_row(); ++w) {
+                uint64_t b0, b1, b2;
+                count_neighbours(open_plane, x, w, b0, b1, b2);
+                for (uint64_t open = open_plane.word(x, w); open != 0; open &= open - 1) {
+                    size_t bit = std::countr_zero(open);
+                    dirs[x][w * BitPlane::WORD_BITS + bit] =
+                        ((b0 >> bit) & 1) | ((b1 >> bit) & 1) << 1 | ((b2 >> bit) & 1) << 2;
+                }
+            }
+        }
+    } else {
+        for (size_t x = 0; x < rows; ++x) {
+            for (size_t y = 0; y < cols; ++y) {
+                if (!open_plane.test(x, y)) continue;
+                for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                    size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                    dirs[x][y] += nx < rows && ny < cols && open_plane.test(nx, ny);
+                });
+            }
+        }
+    }
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+PType FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::random01() noexcept {
     static std::uniform_real_distribution<VFType> dist(0.0, 1.0);
-    return dist(rnd);
+    return dist(*active_rnd);
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
 std::tuple<PType, bool, std::pair<int, int>>
-FluidSimulator<PType, VType, VFType, N, K>::propagate_flow(int x, int y, PType lim) {
-    last_use[x][y] = UT - 1;
-    
-    if (use_static) {
-        return static_propagate_flow(x, y, lim);
-    }
+FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::propagate_flow(int x, int y, PType lim) {
+    set_last_use(x, y, UT - 1);
 
     if (x < 0 || y < 0 || x >= rows || y >= cols || field_data[x][y] == '#') {
         return {PType(0), false, {0, 0}};
@@ -289,475 +644,865 @@ FluidSimulator<PType, VType, VFType, N, K>::propagate_flow(int x, int y, PType l
 
     PType ret = PType(0);
 
-    for (const auto& [dx, dy] : deltas) {
-        int nx = x + dx;
-        int ny = y + dy;
+    std::tuple<PType, bool, std::pair<int, int>> found;
+    bool done = any_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+        int nx = x + Hood::template dx<I>;
+        int ny = y + Hood::template dy<I>;
         
         if (nx < 0 || ny < 0 || nx >= rows || ny >= cols || field_data[nx][ny] == '#') {
-            continue;
+            return false;
         }
 
         if (field_data[nx][ny] != '#' && last_use[nx][ny] < UT) {
-            auto cap = velocity.get(x, y, dx, dy, deltas);
-            auto flow = velocity_flow.get(x, y, dx, dy, deltas);
-            if (flow == cap) {
-                continue;
+            auto cap = velocity.at(x, y, I);
+            auto flow = velocity_flow.at(x, y, I);
+            if (flow >= cap) {
+                return false;
             }
             // assert(v >= velocity_flow.get(x, y, dx, dy));
             auto vp = std::min(lim, cap - flow);
             if (last_use[nx][ny] == UT - 1) {
-                velocity_flow.add(x, y, dx, dy, vp, deltas);
-                last_use[x][y] = UT;
+                add_flow(x, y, I, vp);
+                set_last_use(x, y, UT);
                 // cerr << x << " " << y << " -> " << nx << " " << ny << " " << vp << " / " << lim << "\n";
-                return {vp, 1, {nx, ny}};
+                found = {vp, 1, {nx, ny}};
+                return true;
             }
             auto [t, prop, end] = propagate_flow(nx, ny, vp);
             ret += t;
             if (prop) {
-                velocity_flow.add(x, y, dx, dy, t, deltas);
-                last_use[x][y] = UT;
+                add_flow(x, y, I, t);
+                set_last_use(x, y, UT);
                 // cerr << x << " " << y << " -> " << nx << " " << ny << " " << t << " / " << lim << "\n";
-                return {t, prop && end != std::pair(x, y), end};
+                found = {t, prop && end != std::pair(x, y), end};
+                return true;
             }
         }
+        return false;
+    });
+    if (done) {
+        return found;
     }
-    last_use[x][y] = UT;
+    set_last_use(x, y, UT);
 
     return {ret, 0, {0, 0}};
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-void FluidSimulator<PType, VType, VFType, N, K>::propagate_stop(int x, int y, bool force) {
-    if (use_static) {
-        static_propagate_stop(x, y, force);
-        return;
+// One pass of augmenting flow from every unvisited seed. Seeds whose
+// capacity ran out are dropped on the way. Returns the flow routed and
+// whether any augmentation changed velocity_flow.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+std::pair<PType, bool> FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::flow_sweep() {
+    next_generation();
+    PType gain = PType(0);
+    bool prop = false;
+    std::fill(region_progress.begin(), region_progress.end(), 0);
+    size_t kept = 0;
+    for (size_t cell : flow_seeds) {
+        size_t x = cell / cols, y = cell % cols;
+        // Augmenting paths never leave a region, and a region whose last
+        // sweep made no progress would make none again, so its seeds go.
+        size_t region = regions.empty() ? 0 : cell_region[cell];
+        if (!regions.empty() && !flowing_regions[region]) {
+            continue;
+        }
+        if (!visited_plane.test(x, y)) {
+            size_t seen_updates = flow_updates;
+            auto [t, local_prop, _] = propagate_flow(x, y, 1);
+            if (t > 0 && flow_updates != seen_updates) {
+                prop = true;
+                gain += t;
+                if (!regions.empty()) region_progress[region] = 1;
+            }
+        }
+        if (has_residual(x, y)) {
+            flow_seeds[kept++] = cell;
+        }
     }
+    flow_seeds.resize(kept);
+    flowing_regions.swap(region_progress);
+    return {gain, prop};
+}
 
-    if (!force) {
-        bool stop = true;
-        for (auto [dx, dy] : deltas) {
-            int nx = x + dx, ny = y + dy;
-            if (nx >= 0 && ny >= 0 && nx < static_cast<int>(rows) && ny < static_cast<int>(cols) &&
-                field_data[nx][ny] != '#' && last_use[nx][ny] < UT - 1 && 
-                velocity.get(x, y, dx, dy, deltas) > VFType(0)) {
-                stop = false;
-                break;
+// Open cells with residual capacity towards an open neighbour, in
+// row-major order. A flow search from any other cell finds no edge to
+// follow and routes nothing, so starting only from these gives the same
+// flow as starting from every cell.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::collect_flow_seeds() {
+    flow_seeds.clear();
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (field_data[x][y] != '#' && has_residual(x, y)) {
+                flow_seeds.push_back(x * cols + y);
             }
         }
-        if (!stop) {
+    }
+}
+
+// Flow an early-stopped tick left unrouted: runs the remaining sweeps to
+// completion on the current flow and restores it afterwards, so the tick
+// proceeds with the bounded result. The exact flow is compared edge by
+// edge with the bounded one into flow_stats.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+double FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::flow_residual() {
+    auto saved_flow = std::make_unique<decltype(velocity_flow)>(velocity_flow);
+    double residual = 0;
+    bool prop = true;
+    while (prop) {
+        auto [gain, progress] = flow_sweep();
+        residual += to_double(gain);
+        prop = progress && to_double(gain) >= Hood::min_flow_gain;
+    }
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (field_data[x][y] == '#') continue;
+            for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                if (nx >= rows || ny >= cols) return;
+                double gap = std::abs(to_double(VFType(velocity_flow.at(x, y, I))) -
+                                      to_double(VFType(saved_flow->at(x, y, I))));
+                if (gap > 0) {
+                    flow_stats.max_edge_gap = std::max(flow_stats.max_edge_gap, gap);
+                    ++flow_stats.gap_edges;
+                }
+            });
+        }
+    }
+    velocity_flow = *saved_flow;
+    return residual;
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::propagate_stop(int x, int y, bool force) {
+    if (!force) {
+        bool moving = any_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+            int nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+            return nx >= 0 && ny >= 0 && nx < static_cast<int>(rows) && ny < static_cast<int>(cols) &&
+                   field_data[nx][ny] != '#' && last_use[nx][ny] < UT - 1 &&
+                   velocity.at(x, y, I) > VFType(0);
+        });
+        if (moving) {
             return;
         }
     }
 
-    last_use[x][y] = UT;
-    for (auto [dx, dy] : deltas) {
-        int nx = x + dx, ny = y + dy;
+    set_last_use(x, y, UT);
+    for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+        int nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
         if (nx < 0 || ny < 0 || nx >= rows || ny >= cols) {
-            continue;
+            return;
         }
         if (field_data[nx][ny] == '#' || last_use[nx][ny] == UT || 
-            velocity.get(x, y, dx, dy, deltas) > VFType(0)) {
-            continue; 
+            velocity.at(x, y, I) > VFType(0)) {
+            return; 
         }
         propagate_stop(nx, ny);
+    });
+}
+
+// propagate_stop(x, y, true) as a frontier expansion over bit planes.
+// Each round stops, at once, every open unvisited cell that has a
+// neighbour stopped in the previous round with a non-positive velocity
+// towards it, and has no positive velocity towards an open unvisited
+// cell. The rounds only touch the rows next to the frontier.
+//
+// Both versions give the same final marking. Velocities are fixed during
+// the move sweep, and between chains no cell is at UT - 1, so the
+// recursive version's checks reduce to the two conditions above, which
+// only become true as more cells stop. The recursive version re-checks a
+// neighbour each time a cell stops: a non-forced cell only stops when
+// every unvisited neighbour has a non-positive velocity towards it, so
+// it recurses into all of them. A cell whose conditions hold is
+// therefore always checked again after the stop that made them hold, and
+// both versions compute the least set closed under the rule. Stops
+// inside a move chain can see the chain's origin at UT - 1 and keep the
+// recursive version.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::propagate_stop_frontier(size_t x, size_t y) {
+    const size_t words = open_plane.words_per_row();
+    set_last_use(x, y, UT);
+    stop_frontier.set(x, y);
+    size_t lo = x, hi = x;
+    size_t touched_lo = x, touched_hi = x;
+
+    while (lo <= hi) {
+        size_t row_begin = lo > 0 ? lo - 1 : 0;
+        size_t row_end = std::min(rows, hi + 2);
+        size_t next_lo = rows, next_hi = 0;
+        for (size_t r = row_begin; r < row_end; ++r) {
+            for (size_t w = 0; w < words; ++w) {
+                uint64_t reached = 0, blocked = 0;
+                for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                    constexpr int dx = Hood::template dx<I>, dy = Hood::template dy<I>;
+                    reached |= neighbour_bits([&](size_t nr, size_t nw) {
+                        return stop_frontier.word(nr, nw) & ~positive_planes[I].word(nr, nw);
+                    }, rows, words, r, w, -dx, -dy);
+                    blocked |= positive_planes[I].word(r, w) & neighbour_bits([&](size_t nr, size_t nw) {
+                        return open_plane.word(nr, nw) & ~visited_plane.word(nr, nw);
+                    }, rows, words, r, w, dx, dy);
+                });
+                uint64_t stopped = reached & open_plane.word(r, w) & ~visited_plane.word(r, w) & ~blocked;
+                stop_next.word(r, w) = stopped;
+                if (stopped != 0) {
+                    next_lo = std::min(next_lo, r);
+                    next_hi = std::max(next_hi, r);
+                }
+            }
+        }
+
+        for (size_t r = row_begin; r < row_end; ++r) {
+            stop_frontier.clear_row(r);
+            for (size_t w = 0; w < words; ++w) {
+                for (uint64_t bits = stop_next.word(r, w); bits != 0; bits &= bits - 1) {
+                    set_last_use(r, w * BitPlane::WORD_BITS + std::countr_zero(bits), UT);
+                }
+            }
+        }
+        std::swap(stop_frontier, stop_next);
+        lo = next_lo;
+        hi = next_hi;
+        touched_lo = std::min(touched_lo, row_begin);
+        touched_hi = std::max(touched_hi, row_end - 1);
+    }
+
+    for (size_t r = touched_lo; r <= touched_hi; ++r) {
+        stop_frontier.clear_row(r);
+        stop_next.clear_row(r);
     }
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-PType FluidSimulator<PType, VType, VFType, N, K>::move_prob(int x, int y) {
-    if (use_static) {
-        return static_move_prob(x, y);
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+PType FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::move_prob(int x, int y) {
+    if (!has_visited_neighbour(x, y)) {
+        return move_weights[x][y].sum;
     }
 
     PType sum = PType(0);
-    for (const auto& [dx, dy] : deltas) {
-        int nx = x + dx, ny = y + dy;
+    for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+        int nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
         if (field_data[nx][ny] == '#' || last_use[nx][ny] == UT) {
-            continue;
+            return;
         }
-        VFType v = velocity.get(x, y, dx, dy, deltas);
+        VFType v = velocity.at(x, y, I);
         if (v >= VFType(0)) {
             sum += v;
         }
-    }
+    });
     return sum;
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-void FluidSimulator<PType, VType, VFType, N, K>::run(size_t steps, size_t checkpoint_interval) {
-    std::vector<std::vector<int>> dirs(rows, std::vector<int>(cols, 0));
-
-    if (!use_static) {
-        for (size_t x = 0; x < rows; ++x) {
-            for (size_t y = 0; y < cols; ++y) {
-                if (field_data[x][y] == '#') continue;
-                for (auto [dx, dy] : deltas) {
-                    if (x + dx >= 0 && x + dx < rows && y + dy >= 0 && y + dy < cols) {
-                        dirs[x][y] += (field_data[x + dx][y + dy] != '#');
-                    }
-                }
-            }
-        }
-    } else {
-        for (size_t x = 0; x < rows; ++x) {
-            for (size_t y = 0; y < cols; ++y) {
-                if (field[x][y] == '#') continue;
-                for (auto [dx, dy] : deltas) {
-                    if (x + dx >= 0 && x + dx < rows && y + dy >= 0 && y + dy < cols) {
-                        dirs[x][y] += (field[x + dx][y + dy] != '#');
-                    }
-                }
-            }
-        }
+// Pressure exchange across the edge between (x, y) and its neighbour in
+// direction I, which must be a forward direction. The cell with the higher
+// old pressure pushes on the other one; the edge's two velocity slots are
+// the only velocities touched. Returns the force left over for the
+// sender's pressure, positive if (x, y) sent it and negative if its
+// neighbour did.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+template<size_t I>
+PType FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::exchange_pressure(size_t x, size_t y) {
+    static_assert(Hood::template forward<I>);
+    constexpr size_t J = Hood::template opposite<I>;
+    size_t bx = x + Hood::template dx<I>, by = y + Hood::template dy<I>;
+    if (field_data[x][y] == '#' || field_data[bx][by] == '#' || old_p[x][y] == old_p[bx][by]) {
+        return PType(0);
     }
+    bool forward = old_p[bx][by] < old_p[x][y];
+    size_t sx = forward ? x : bx, sy = forward ? y : by;
+    size_t nx = forward ? bx : x, ny = forward ? by : y;
+    size_t send_dir = forward ? I : J, receive_dir = forward ? J : I;
+
+    auto delta_p = old_p[sx][sy] - old_p[nx][ny];
+    auto force = delta_p;
+    auto &contr = velocity.at(nx, ny, receive_dir);
+    if (contr * rho[(int) field_data[nx][ny]] >= force) {
+        contr -= force / rho[(int) field_data[nx][ny]];
+        return PType(0);
+    }
+    force -= contr * rho[(int) field_data[nx][ny]];
+    contr = 0;
+    velocity.at(sx, sy, send_dir) += VStore(force / rho[(int) field_data[sx][sy]]);
+    return forward ? force : -force;
+}
 
-    for (size_t step = 0; step < steps; ++step) {
-        std::cout << "Starting step " << step + 1 << "\n";
-
-        PType total_delta_p = PType(0);
+// Gravity, the old_p snapshot and the pressure forces in one sweep over
+// column bands of FORCE_TILE_COLS cells. Within a band, row x + 1 is
+// snapshotted, row x gets gravity, then every edge of row x in a forward
+// direction (to the right or into row x + 1) exchanges pressure once, and
+// finally p of row x is updated from the forces of all its edges in deltas
+// order: forward edges from this row, left edges from the previous column
+// and upward edges from the previous row. Edges only touch their own two
+// velocity slots, so they are independent, and the results are identical
+// to three full-grid sweeps visiting every cell and direction. The band
+// also snapshots its right halo column and hands its last column's edge
+// forces to the next band. Diagonal edges would need forces from both
+// neighbouring bands, so neighbourhoods with diagonals use a single band.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::apply_forces(PType& total_delta_p) {
+    constexpr size_t FORCE_TILE_COLS = 256;
+    constexpr size_t DOWN = Hood::index(1, 0), RIGHT = Hood::index(0, 1);
+    // Shadows the member so that width engines loop to a constant.
+    const size_t cols = width();
+    const size_t tile_cols = Hood::has_diagonals ? cols : FORCE_TILE_COLS;
+
+    std::vector<PType> band_left_force(rows, PType(0));
+    // Forces of the forward edges of row x and of row x - 1, by direction.
+    std::array<std::vector<PType>, D> row_force, prev_force;
+
+    for (size_t y0 = 0; y0 < cols; y0 += tile_cols) {
+        size_t y1 = std::min(cols, y0 + tile_cols);
+        size_t halo_end = std::min(cols, y1 + 1);
+        for (size_t i = 0; i < D; ++i) {
+            row_force[i].assign(y1 - y0, PType(0));
+            prev_force[i].assign(y1 - y0, PType(0));
+        }
 
-        if (!use_static) {
-            std::cout << "Applying gravity...\n";
+        snapshot_pressure(0, y0, halo_end);
 
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    if (field_data[x][y] == '#') continue;
-                    if (field_data[x + 1][y] != '#')
-                        velocity.add(x, y, 1, 0, g, deltas);
-                }
+        for (size_t x = 0; x < rows; ++x) {
+            if (x + 1 < rows) {
+                snapshot_pressure(x + 1, y0, halo_end);
             }
 
-            old_p = p;
-
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    if (field_data[x][y] == '#')
-                        continue;
-                    for (auto [dx, dy] : deltas) {
-                        int nx = x + dx, ny = y + dy;
-                        if (nx < 0 || ny < 0 || nx >= rows || ny >= cols) {continue;}
-                        if (field_data[nx][ny] != '#' && old_p[nx][ny] < old_p[x][y]) {
-                            auto delta_p = old_p[x][y] - old_p[nx][ny];
-                            auto force = delta_p;
-                            auto &contr = velocity.get(nx, ny, -dx, -dy, deltas);
-                            if (contr * rho[(int) field_data[nx][ny]] >= force) {
-                                contr -= force / rho[(int) field_data[nx][ny]];
-                                continue;
-                            }
-                            force -= contr * rho[(int) field_data[nx][ny]];
-                            contr = 0;
-                            velocity.add(x, y, dx, dy, force / rho[(int) field_data[x][y]], deltas);
-                            p[x][y] -= force / dirs[x][y];
-                            total_delta_p -= force / dirs[x][y];
-                        }
-                    }
-                }
+            for (size_t y = y0; y < y1; ++y) {
+                if (field_data[x][y] == '#') continue;
+                if (x + 1 < rows && field_data[x + 1][y] != '#')
+                    velocity.at(x, y, DOWN) += VStore(g);
             }
 
-            velocity_flow = {};
-            velocity_flow.init(rows, cols);
-
-            bool prop = false;
-            do {
-                UT += 2;
-                prop = false;
-                for (size_t x = 0; x < rows; ++x) {
-                    for (size_t y = 0; y < cols; ++y) {
-                        if (field_data[x][y] != '#' && last_use[x][y] != UT) {
-                            auto [t, local_prop, _] = propagate_flow(x, y, 1);
-                            if (t > 0) {
-                                prop = true;
-                            }
-                        }
+            for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                if constexpr (Hood::template forward<I>) {
+                    for (size_t y = y0; y < y1; ++y) {
+                        size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                        row_force[I][y - y0] = nx < rows && ny < cols ? exchange_pressure<I>(x, y) : PType(0);
                     }
                 }
-            } while (prop);
-
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    if (field_data[x][y] == '#')
-                        continue;
-                    for (auto [dx, dy] : deltas) {
-                        int nx = x + dx, ny = y + dy;
-                        if (nx < 0 || ny < 0 || nx >= rows || ny >= cols) {continue;}
-                        auto old_v = velocity.get(x, y, dx, dy, deltas);
-                        auto new_v = velocity_flow.get(x, y, dx, dy, deltas);
-                        if (old_v > 0) {
-                            assert(new_v <= old_v);
-                            velocity.get(x, y, dx, dy, deltas) = new_v;
-                            auto force = (old_v - new_v) * rho[(int) field_data[x][y]];
-                            if (field_data[x][y] == '.')
-                                force *= 0.8;
-                            if (field_data[nx][ny] == '#') {
-                                p[x][y] += force / dirs[x][y];
-                                total_delta_p += force / dirs[x][y];
-                            } else {
-                                p[nx][ny] += force / dirs[nx][ny];
-                                total_delta_p += force / dirs[nx][ny];
-                            }
-                        }
-                    }
-                }
-            }
+            });
 
-            UT += 2;
-            prop = false;
-
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    if (field_data[x][y] != '#' && last_use[x][y] != UT) {
-                        auto pr = random01();
-                        auto pr1 = move_prob(x, y);
-                        if (pr < pr1) {
-                            prop = true;
-                            propagate_move(x, y, true);
-                        } else {
-                            propagate_stop(x, y, true);
-                        }
+            for (size_t y = y0; y < y1; ++y) {
+                if (field_data[x][y] == '#')
+                    continue;
+                for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                    constexpr size_t J = Hood::template opposite<I>;
+                    constexpr int dy = Hood::template dy<I>;
+                    PType force;
+                    if constexpr (Hood::template forward<I>) {
+                        force = row_force[I][y - y0];
+                    } else if constexpr (Hood::template dx<I> == 0) {
+                        force = -(y == y0 ? band_left_force[x] : row_force[J][y - y0 - 1]);
+                    } else {
+                        size_t ny = y + dy;
+                        force = ny - y0 < y1 - y0 ? -prev_force[J][ny - y0] : PType(0);
                     }
-                }
-            }
-
-            if (prop) {
-                std::cout << "Tick " << step++ << ":\n";
-                for (size_t x = 0; x < rows; ++x) {
-                    std::cout << field_data[x] << "\n";
-                }
-            }
-
-        } else {
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    if (field[x][y] == '#') continue;
-                    if (x + 1 < rows && field[x + 1][y] != '#') {
-                        static_velocity.add(x, y, 1, 0, g, deltas);
+                    if (force > PType(0)) {
+                        p[x][y] -= force / dirs[x][y];
+                        total_delta_p -= force / dirs[x][y];
                     }
-                }
+                });
             }
 
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    static_old_p[x][y] = static_p[x][y];
-                }
-            }
-
-            static_velocity_flow = {};
-
-            bool prop;
-            do {
-                UT += 2;
-                prop = false;
-                for (size_t x = 0; x < rows; ++x) {
-                    for (size_t y = 0; y < cols; ++y) {
-                        if (field[x][y] != '#' && static_last_use[x][y] != UT) {
-                            if (random01() < static_move_prob(x, y)) {
-                                prop = true;
-                                static_propagate_move(x, y, true);
-                            } else {
-                                static_propagate_stop(x, y, true);
-                            }
-                        }
-                    }
-                }
-            } while (prop);
-
-            for (size_t x = 0; x < rows; ++x) {
-                for (size_t y = 0; y < cols; ++y) {
-                    if (field[x][y] == '#') continue;
-                    for (auto [dx, dy] : deltas) {
-                        auto old_v = static_velocity.get(x, y, dx, dy, deltas);
-                        auto new_v = static_velocity_flow.get(x, y, dx, dy, deltas);
-                        if (old_v > 0) {
-                            static_velocity.add(x, y, dx, dy, new_v - old_v, deltas);
-                            auto force = (old_v - new_v) * rho[(int)field[x][y]];
-                            if (field[x][y] == '.') force *= PType(0.8);
-
-                            size_t nx = x + dx, ny = y + dy;
-                            if (nx < rows && ny < cols && field[nx][ny] == '#') {
-                                static_p[x][y] += force / PType(dirs[x][y]);
-                                total_delta_p += force / PType(dirs[x][y]);
-                            } else if (nx < rows && cols < cols) {
-                                static_p[nx][ny] += force / PType(dirs[nx][ny]);
-                                total_delta_p += force / PType(dirs[nx][ny]);
-                            }
-                        }
-                    }
-                }
-            }
+            band_left_force[x] = row_force[RIGHT][y1 - y0 - 1];
+            std::swap(row_force, prev_force);
         }
-
     }
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-std::tuple<PType, bool, std::pair<size_t, size_t>>
-FluidSimulator<PType, VType, VFType, N, K>::static_propagate_flow(size_t x, size_t y, PType lim) {
-    if (x >= rows || y >= cols || field[x][y] == '#') {
-        return {PType(0), false, {0, 0}};
+// Applies the recorded swaps of a move chain as one permutation. Chain
+// discovery only reads walls, velocities and last_use, none of which a
+// swap changes, so deferring the swaps to the end of the chain gives the
+// same result. The permutation is composed on slot indices first, then
+// types and pressures are gathered and scattered field by field over the
+// affected cells in increasing index order. Velocities stay with their
+// cells, as they did when swaps were applied one at a time.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::apply_pending_moves() {
+    if (pending_swaps.empty()) {
+        return;
     }
 
-    PType sum_flow = PType(0);
-    bool has_flow = false;
-    std::pair<size_t, size_t> max_flow_pos{0, 0};
-    PType max_flow = PType(0);
+    move_cells.clear();
+    for (auto [a, b] : pending_swaps) {
+        move_cells.push_back(a);
+        move_cells.push_back(b);
+    }
+    std::sort(move_cells.begin(), move_cells.end());
+    move_cells.erase(std::unique(move_cells.begin(), move_cells.end()), move_cells.end());
 
-    for (const auto& [dx, dy] : deltas) {
-        size_t nx = x + dx;
-        size_t ny = y + dy;
-        
-        if (nx >= rows || ny >= cols || field[nx][ny] == '#') {
-            continue;
+    auto slot = [&](size_t cell) {
+        return std::lower_bound(move_cells.begin(), move_cells.end(), cell) - move_cells.begin();
+    };
+    move_sources.resize(move_cells.size());
+    for (size_t i = 0; i < move_sources.size(); ++i) {
+        move_sources[i] = i;
+    }
+    for (auto [a, b] : pending_swaps) {
+        std::swap(move_sources[slot(a)], move_sources[slot(b)]);
+    }
+    pending_swaps.clear();
+
+    move_types.resize(move_cells.size());
+    for (size_t i = 0; i < move_cells.size(); ++i) {
+        size_t src = move_cells[move_sources[i]];
+        move_types[i] = field_data[src / cols][src % cols];
+        if (src != move_cells[i]) {
+            move_log.push_back({static_cast<uint32_t>(src), static_cast<uint32_t>(move_cells[i])});
         }
-
-        PType dp = static_p[x][y] - static_p[nx][ny];
-        if (dp <= PType(0)) {
-            continue;
+    }
+    for (size_t i = 0; i < move_cells.size(); ++i) {
+        char& type = field_data[move_cells[i] / cols][move_cells[i] % cols];
+        if (material_lists_valid && type != move_types[i]) {
+            move_material(move_cells[i], type, move_types[i]);
         }
+        type = move_types[i];
+    }
 
-        PType flow = std::min(dp, lim);
-        sum_flow += flow;
-        has_flow = true;
+    move_pressures.resize(move_cells.size());
+    for (size_t i = 0; i < move_cells.size(); ++i) {
+        size_t src = move_cells[move_sources[i]];
+        move_pressures[i] = p[src / cols][src % cols];
+    }
+    for (size_t i = 0; i < move_cells.size(); ++i) {
+        p[move_cells[i] / cols][move_cells[i] % cols] = move_pressures[i];
+    }
+}
 
-        if (flow > max_flow) {
-            max_flow = flow;
-            max_flow_pos = {nx, ny};
+// The sums are accumulated in the same order as move_prob and
+// propagate_move, so the cached values are bit-identical to a fresh sum.
+// Walls and non-positive velocities contribute zero; a wall direction then
+// repeats the previous prefix, which selects the same direction as the 0
+// that propagate_move stores for it.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::update_move_weights(size_t x, size_t y) {
+    MoveWeights& w = move_weights[x][y];
+    std::array<VFType, D> velocities{};
+    std::array<bool, D> mask{};
+    w.sum = PType(0);
+    for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+        size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+        velocities[I] = velocity.at(x, y, I);
+        mask[I] = nx < rows && ny < cols && field_data[nx][ny] != '#' && velocities[I] > VFType(0);
+        w.sum += mask[I] ? velocities[I] : VFType(0);
+        if (options.frontier_stop) {
+            positive_planes[I].assign(x, y, velocities[I] > VFType(0));
         }
-
-        static_velocity_flow.add(x, y, dx, dy, flow, deltas);
+    });
+    w.thresholds = masked_prefix_sums(velocities, mask);
+    if (w.sum > PType(0)) {
+        move_candidates.push_back(x * cols + y);
     }
-
-    return {sum_flow, has_flow, max_flow_pos};
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-void FluidSimulator<PType, VType, VFType, N, K>::static_propagate_stop(size_t x, size_t y, bool force) {
-    if (x >= rows || y >= cols || field[x][y] == '#') {
+// Replaces the velocities of every open cell with the flow routed along
+// them and turns the difference into pressure on the receiving cell (the
+// cell itself for a wall). Collects the move candidates in row-major order.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::recompute_velocities(PType& total_delta_p) {
+#ifdef EDGE_VELOCITY
+    if constexpr (D == 4) {
+        recompute_velocities_edges(total_delta_p);
         return;
     }
+#endif
+    // Shadows the member so that width engines loop to a constant.
+    const size_t cols = width();
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (field_data[x][y] == '#')
+                continue;
+            for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                int nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                if (nx < 0 || ny < 0 || nx >= rows || ny >= cols) {return;}
+                VFType old_v = velocity.at(x, y, I);
+                // add_flow saturates, but the flow is stored in its own
+                // format, which may round the capacity itself up.
+                VFType new_v = std::min<VFType>(velocity_flow.at(x, y, I), old_v);
+                if (old_v > 0) {
+                    velocity.at(x, y, I) = new_v;
+                    auto force = (old_v - new_v) * rho[(int) field_data[x][y]];
+                    if (field_data[x][y] == '.')
+                        force *= 0.8;
+                    if (field_data[nx][ny] == '#') {
+                        p[x][y] += force / dirs[x][y];
+                        total_delta_p += force / dirs[x][y];
+                    } else {
+                        p[nx][ny] += force / dirs[nx][ny];
+                        total_delta_p += force / dirs[nx][ny];
+                    }
+                }
+            });
+            update_move_weights(x, y);
+        }
+    }
+}
 
-    bool should_stop = force;
-    if (!force) {
-        PType v_sum = PType(0);
-        for (const auto& [dx, dy] : deltas) {
-            v_sum += abs(static_velocity.get(x, y, dx, dy, deltas));
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::build_material_lists() {
+    for (auto& cells : material_cells) {
+        cells.clear();
+    }
+    material_slot.init(rows, cols, 0);
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (field_data[x][y] == '#') continue;
+            auto& cells = material_cells[static_cast<unsigned char>(field_data[x][y])];
+            material_slot[x][y] = static_cast<uint32_t>(cells.size());
+            cells.push_back(x * cols + y);
         }
-        should_stop = v_sum < PType(0.1);
+    }
+    recompute_forces.init(rows, cols);
+    recompute_forces_valid = true;
+    material_lists_valid = true;
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::move_material(size_t cell, char from, char to) {
+    auto& old_cells = material_cells[static_cast<unsigned char>(from)];
+    uint32_t slot = material_slot[cell / cols][cell % cols];
+    size_t last = old_cells.back();
+    old_cells[slot] = last;
+    material_slot[last / cols][last % cols] = slot;
+    old_cells.pop_back();
+
+    auto& new_cells = material_cells[static_cast<unsigned char>(to)];
+    material_slot[cell / cols][cell % cols] = static_cast<uint32_t>(new_cells.size());
+    new_cells.push_back(cell);
+}
+
+// recompute_velocities in two passes. The first walks the cells material
+// by material, so rho and the damping factor are constants of the inner
+// loop; it updates the velocities, which only involve the cell itself,
+// and records the forces. The second applies the forces to the pressures
+// and rebuilds the move weights in row-major order, which keeps every sum
+// in the order of the single-pass kernel and the results bit-identical.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::recompute_velocities_grouped(PType& total_delta_p) {
+    if (!material_lists_valid) {
+        build_material_lists();
     }
 
-    if (should_stop) {
-        for (const auto& [dx, dy] : deltas) {
-            static_velocity.add(x, y, dx, dy, PType(0), deltas);
+    for (size_t m = 0; m < material_cells.size(); ++m) {
+        const auto& cells = material_cells[m];
+        if (cells.empty()) continue;
+        const PType material_rho = rho[m];
+        const bool damped = m == static_cast<unsigned char>('.');
+        for (size_t cell : cells) {
+            size_t x = cell / cols, y = cell % cols;
+            CellForces& forces = recompute_forces[x][y];
+            forces.mask = 0;
+            for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                if (nx >= rows || ny >= cols) return;
+                VFType old_v = velocity.at(x, y, I);
+                // add_flow saturates, but the flow is stored in its own
+                // format, which may round the capacity itself up.
+                VFType new_v = std::min<VFType>(velocity_flow.at(x, y, I), old_v);
+                if (old_v > 0) {
+                    velocity.at(x, y, I) = new_v;
+                    auto force = (old_v - new_v) * material_rho;
+                    if (damped)
+                        force *= 0.8;
+                    forces.force[I] = force;
+                    forces.mask |= 1u << I;
+                }
+            });
         }
     }
+
+    apply_recompute_forces(total_delta_p);
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-PType FluidSimulator<PType, VType, VFType, N, K>::static_move_prob(size_t x, size_t y) {
-    if (x >= rows || y >= cols || field[x][y] == '#') {
-        return PType(0);
+#ifdef EDGE_VELOCITY
+// recompute_velocities over the edge layout: walks x_edges and then
+// y_edges in storage order and updates both velocities of an edge from
+// the flow of the same edge, recording the forces per cell. Edges on the
+// border of the map have no cell beyond them and are skipped, as the
+// per-cell kernel skips those directions. The forces are then applied in
+// row-major order, so the results are bit-identical.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::recompute_velocities_edges(PType& total_delta_p) {
+    if (!recompute_forces_valid) {
+        recompute_forces.init(rows, cols);
+        recompute_forces_valid = true;
     }
+    auto update = [&](size_t x, size_t y, size_t dir, VStore& velocity_slot, const VFStore& flow_slot) {
+        if (field_data[x][y] == '#') return;
+        VFType old_v = velocity_slot;
+        VFType new_v = std::min<VFType>(flow_slot, old_v);
+        if (old_v > 0) {
+            velocity_slot = new_v;
+            auto force = (old_v - new_v) * rho[(int) field_data[x][y]];
+            if (field_data[x][y] == '.')
+                force *= 0.8;
+            CellForces& forces = recompute_forces[x][y];
+            forces.force[dir] = force;
+            forces.mask |= 1u << dir;
+        }
+    };
+    for (size_t x = 1; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            auto& v = velocity.x_edge(x, y);
+            const auto& flow = velocity_flow.x_edge(x, y);
+            update(x - 1, y, 1, v[0], flow[0]);
+            update(x, y, 0, v[1], flow[1]);
+        }
+    }
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 1; y < cols; ++y) {
+            auto& v = velocity.y_edge(x, y);
+            const auto& flow = velocity_flow.y_edge(x, y);
+            update(x, y - 1, 3, v[0], flow[0]);
+            update(x, y, 2, v[1], flow[1]);
+        }
+    }
+    apply_recompute_forces(total_delta_p);
+}
+#endif
 
-    PType sum = PType(0);
-    for (const auto& [dx, dy] : deltas) {
-        VFType v = static_velocity.get(x, y, dx, dy, deltas);
-        if (v > VFType(0)) {
-            sum += v;
+// Second pass of the grouped and the edge-major recompute: adds the
+// recorded forces to the pressures and rebuilds the move weights in
+// row-major order, clearing the masks for the next tick.
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::apply_recompute_forces(PType& total_delta_p) {
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            if (field_data[x][y] == '#')
+                continue;
+            CellForces& forces = recompute_forces[x][y];
+            for_each_direction<Hood>([&]<size_t I>(std::integral_constant<size_t, I>) {
+                if (!(forces.mask & (1u << I))) return;
+                size_t nx = x + Hood::template dx<I>, ny = y + Hood::template dy<I>;
+                auto force = forces.force[I];
+                if (field_data[nx][ny] == '#') {
+                    p[x][y] += force / dirs[x][y];
+                    total_delta_p += force / dirs[x][y];
+                } else {
+                    p[nx][ny] += force / dirs[nx][ny];
+                    total_delta_p += force / dirs[nx][ny];
+                }
+            });
+            forces.mask = 0;
+            update_move_weights(x, y);
         }
     }
-    return sum; 
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-bool FluidSimulator<PType, VType, VFType, N, K>::static_propagate_move(size_t x, size_t y, bool is_first) {
-    if (x >= rows || y >= cols || field[x][y] == '#') {
-        return false;
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+bool FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::tick() {
+    PType total_delta_p = PType(0);
+    tick_cost = TickCost{};
+
+    if (!options.stats_path.empty() && !stats_writer) {
+        stats_writer = std::make_unique<analytics::StatsWriter>(options.stats_path, options.stats_binary, field_data);
+        stats_outlet_row = stats_writer->outletRow();
+    }
+    if (options.frontier_stop && stop_frontier.rows() != rows) {
+        for (auto& plane : positive_planes) {
+            plane.init(rows, cols);
+        }
+        stop_frontier.init(rows, cols);
+        stop_next.init(rows, cols);
+    }
+    bool collect_stats = stats_writer && ticks % options.stats_interval == 0;
+    if (collect_stats) {
+        tick_stats.reset();
+        accumulate_stats();
+        stats_writer->write(ticks, tick_stats);
     }
 
-    if (!is_first && static_last_use[x][y] == UT) {
-        return false;
+    apply_forces(total_delta_p);
+    ++ticks;
+
+    velocity_flow.reset();
+    std::fill(flowing_regions.begin(), flowing_regions.end(), 1);
+    collect_flow_seeds();
+
+    bool prop = false;
+    size_t sweeps = 0;
+    const double min_flow_gain = std::max(options.min_flow_gain, Hood::min_flow_gain);
+    do {
+        auto [gain, progress] = flow_sweep();
+        prop = progress;
+        ++sweeps;
+        flow_stats.routed += to_double(gain);
+        if (options.max_flow_sweeps > 0 && sweeps >= options.max_flow_sweeps) break;
+        if (min_flow_gain > 0 && to_double(gain) < min_flow_gain) break;
+    } while (prop);
+    flow_stats.sweeps += sweeps;
+    tick_cost.flow_sweeps = sweeps;
+    if (prop) {
+        ++flow_stats.stopped_ticks;
+        // The last allowed sweep may have finished the flow; only the
+        // residual tells whether the bound cost anything.
+        if (options.measure_flow_residual) {
+            double residual = flow_residual();
+            flow_stats.residual += residual;
+            flow_stats.capped_ticks += residual > 0;
+        }
     }
-    static_last_use[x][y] = UT - is_first;
 
-    std::array<VFType, 4> thresholds;
-    VFType sum = VFType(0);
-    
-    for (size_t i = 0; i < deltas.size(); ++i) {
-        auto [dx, dy] = deltas[i];
-        size_t nx = x + dx, ny = y + dy;
-        
-        if (nx >= rows || ny >= cols || field[nx][ny] == '#' || static_last_use[nx][ny] == UT) {
-            thresholds[i] = sum;
-            continue;
+    move_candidates.clear();
+    if (options.material_order) {
+        recompute_velocities_grouped(total_delta_p);
+    } else {
+        recompute_velocities(total_delta_p);
+    }
+
+    next_generation();
+    prop = false;
+    std::fill(moved_regions.begin(), moved_regions.end(), 0);
+    move_log.clear();
+
+    // Unvisited cells are taken in row-major order and every one that does
+    // not move is stopped, so later chains see the same stopped cells in
+    // either mode. Without compat_rng only move candidates draw a number:
+    // a cell without move weight can never pass the test, so it is
+    // stopped without a draw, and only the random stream differs.
+    size_t next_candidate = 0;
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = visited_plane.next_clear(x, 0, wall_plane); y < cols;
+             y = visited_plane.next_clear(x, y + 1, wall_plane)) {
+            size_t cell = x * cols + y;
+            while (next_candidate < move_candidates.size() && move_candidates[next_candidate] < cell) {
+                ++next_candidate;
+            }
+            bool candidate = next_candidate < move_candidates.size() && move_candidates[next_candidate] == cell;
+            size_t region = enter_region(x, y);
+            if (options.compat_rng || candidate) {
+                auto pr = random01();
+                auto pr1 = move_prob(x, y);
+                if (pr < pr1) {
+                    prop = true;
+                    if (!moved_regions.empty()) moved_regions[region] = 1;
+                    propagate_move(x, y, true);
+                    continue;
+                }
+            }
+            if (options.frontier_stop) {
+                propagate_stop_frontier(x, y);
+            } else {
+                propagate_stop(x, y, true);
+            }
         }
-        
-        VFType v = static_velocity.get(x, y, dx, dy, deltas);
-        if (v <= VFType(0)) {
-            thresholds[i] = sum;
-            continue;
+    }
+
+    return prop;
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::run(size_t steps, size_t checkpoint_interval) {
+    for (size_t step = 0; step < steps; ++step) {
+        std::cout << "Starting step " << step + 1 << "\n";
+        std::cout << "Applying gravity...\n";
+
+        if (tick()) {
+            print_frame(std::cout, step++);
         }
-        
-        sum += v;
-        thresholds[i] = sum;
     }
 
-    if (sum == VFType(0)) {
-        return false;
+    if (options.max_flow_sweeps > 0 || options.min_flow_gain > 0) {
+        std::cout << "Flow: " << flow_stats.sweeps << " sweeps, "
+                  << flow_stats.stopped_ticks << " ticks stopped by the bound, "
+                  << flow_stats.routed << " flow routed";
+        if (options.measure_flow_residual) {
+            double total = flow_stats.routed + flow_stats.residual;
+            std::cout << ", " << flow_stats.capped_ticks << " ticks left flow unrouted, "
+                      << flow_stats.residual << " in all ("
+                      << (total > 0 ? 100.0 * flow_stats.residual / total : 0.0) << "% of exact); "
+                      << flow_stats.gap_edges << " edge flows differed from exact, by at most "
+                      << flow_stats.max_edge_gap;
+        }
+        std::cout << "\n";
     }
 
-    VFType r = random01() * sum;
-    size_t dir = std::upper_bound(thresholds.begin(), thresholds.end(), r) - thresholds.begin();
-    
-    auto [dx, dy] = deltas[dir];
-    size_t nx = x + dx, ny = y + dy;
+    print_storage_stats<PStore>(std::cout, "Pressure");
+    print_storage_stats<VStore>(std::cout, "Velocity");
+    print_storage_stats<VFStore>(std::cout, "Velocity flow");
+}
 
-    bool moved = (static_last_use[nx][ny] == UT - 1) || static_propagate_move(nx, ny, false);
-    
-    if (moved && !is_first) {
-        std::swap(field[x][y], field[nx][ny]);
-        std::swap(static_p[x][y], static_p[nx][ny]);
-        
-        auto tmp_vel = static_velocity.get_array(x, y);
-        static_velocity.set_array(x, y, static_velocity.get_array(nx, ny));
-        static_velocity.set_array(nx, ny, tmp_vel);
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+uint64_t FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::state_hash() const {
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](const auto& value) {
+        const auto* bytes = reinterpret_cast<const unsigned char*>(&value);
+        for (size_t i = 0; i < sizeof(value); ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    };
+    mix(rows);
+    mix(cols);
+    mix(UT);
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            mix(field_data[x][y]);
+            mix(p[x][y]);
+            for (size_t i = 0; i < deltas.size(); ++i) {
+                mix(velocity.at(x, y, i));
+            }
+        }
     }
+    return hash;
+}
 
-    return moved;
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+FieldValues FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::field_values() const {
+    FieldValues values;
+    values.pressure.reserve(rows * cols);
+    values.velocity.reserve(rows * cols * D);
+    for (size_t x = 0; x < rows; ++x) {
+        for (size_t y = 0; y < cols; ++y) {
+            values.pressure.push_back(to_double(PType(p[x][y])));
+            for (size_t i = 0; i < D; ++i) {
+                values.velocity.push_back(to_double(VFType(velocity.at(x, y, i))));
+            }
+        }
+    }
+    return values;
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-void FluidSimulator<PType, VType, VFType, N, K>::save_state(const char* filename) {
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::save_state(const char* filename) {
     std::ofstream file(filename);
     if (!file.is_open()) {
         throw std::runtime_error("Error opening file for saving state");
     }
-    file << rows << " " << cols << std::endl;
-    file << g << std::endl;
+    // Everything load_state reads back, with enough digits that values
+    // survive the round trip.
+    file << std::setprecision(std::numeric_limits<double>::max_digits10);
+    file << rows << " " << cols << "\n";
+    file << g << "\n";
     
-    if (!use_static) {
-        for (size_t x = 0; x < rows; x++) {
-            file << field_data[x] << std::endl;
+    for (size_t x = 0; x < rows; x++) {
+        file << field_data[x] << "\n";
+    }
+
+    for (size_t x = 0; x < rows; x++) {
+        for (size_t y = 0; y < cols; y++) {
+            file << p[x][y] << " " << old_p[x][y] << " ";
         }
-    } else {
-        for (size_t x = 0; x < rows; x++) {
-            for (size_t y = 0; y < cols; y++) {
-                file << field[x][y];
+        file << "\n";
+    }
+    for (size_t x = 0; x < rows; x++) {
+        for (size_t y = 0; y < cols; y++) {
+            for (size_t k = 0; k < D; k++) {
+                file << velocity.at(x, y, k) << " ";
             }
-            file << std::endl;
         }
+        file << "\n";
     }
+    file << UT << "\n";
 
     double default_rho = 0.01;
     for (size_t i = 0; i < rho.size(); ++i) {
         if (rho[i] != static_cast<PType>(default_rho)) {
-            file << static_cast<char>(i) << " = " << rho[i] << std::endl;
+            file << static_cast<char>(i) << " = " << rho[i] << "\n";
         }
     }
 
     file.close();
 }
 
-template<typename PType, typename VType, typename VFType, size_t N, size_t K>
-void FluidSimulator<PType, VType, VFType, N, K>::load_state(const char* filename) {
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::load_state(const char* filename) {
     std::ifstream file(filename);
     if (!file) {
         throw std::runtime_error("Failed to open file for reading");
@@ -767,76 +1512,60 @@ void FluidSimulator<PType, VType, VFType, N, K>::load_state(const char* filename
     file >> new_rows >> new_cols;
     file >> g;
 
-    if (use_static) {
-        if (new_rows > rows || new_cols > cols) {
-            throw std::runtime_error("Saved dimensions exceed static allocation");
-        }
-        for (size_t i = 0; i < new_rows; i++) {
-            std::string line;
-            file >> line;
-            for (size_t j = 0; j < new_cols; j++) {
-                field[i][j] = line[j];
-            }
-        }
-
-        for (size_t i = 0; i < new_rows; i++) {
-            for (size_t j = 0; j < new_cols; j++) {
-                file >> static_p[i][j];
-                file >> static_old_p[i][j];
-            }
-        }
-
-        static_velocity.init(new_rows, new_cols);
-        static_velocity_flow.init(new_rows, new_cols);
+    if ((N > 0 && new_rows > N) || (K > 0 && new_cols > K)) {
+        throw std::runtime_error("Saved dimensions exceed static allocation");
+    }
+    if (N == 0 && K > 0 && new_cols != K) {
+        throw std::runtime_error("Saved width does not match the engine width");
+    }
 
-        for (size_t i = 0; i < new_rows; i++) {
-            for (size_t j = 0; j < new_cols; j++) {
-                for (size_t k = 0; k < 4; k++) {
-                    VFType val;
-                    file >> val;
-                    static_velocity.add(i, j, deltas[k].first, deltas[k].second, val, deltas);
-                }
-            }
+    // Rows hold spaces, so they are read as whole lines.
+    file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    field_data.resize(new_rows);
+    for (size_t i = 0; i < new_rows; i++) {
+        std::getline(file, field_data[i]);
+        if (field_data[i].size() < new_cols) {
+            throw std::runtime_error("Saved map row " + std::to_string(i) + " is too short");
         }
+    }
 
-        file >> UT;
-        rows = new_rows;
-        cols = new_cols;
-    } else {
-        field_data.resize(new_rows);
-        for (size_t i = 0; i < new_rows; i++) {
-            file >> field_data[i];
-        }
+    rows = new_rows;
+    cols = new_cols;
+    allocate_fields();
 
-        p.resize(new_rows, std::vector<PType>(new_cols));
-        old_p.resize(new_rows, std::vector<PType>(new_cols));
-        
-        for (size_t i = 0; i < new_rows; i++) {
-            for (size_t j = 0; j < new_cols; j++) {
-                file >> p[i][j];
-                file >> old_p[i][j];
+    // Wall cells of a block-sparse field may share storage, so their saved
+    // values are read and dropped; they start out zero like any wall.
+    auto keep = [&](size_t i, size_t j) {
+        return decltype(p)::contiguous || field_data[i][j] != '#';
+    };
+    for (size_t i = 0; i < new_rows; i++) {
+        for (size_t j = 0; j < new_cols; j++) {
+            PStore saved_p, saved_old_p;
+            file >> saved_p;
+            file >> saved_old_p;
+            if (keep(i, j)) {
+                p[i][j] = saved_p;
+                old_p[i][j] = saved_old_p;
             }
         }
+    }
 
-        velocity.init(new_rows, new_cols);
-        velocity_flow.init(new_rows, new_cols);
-        last_use.resize(new_rows, std::vector<int>(new_cols));
-        
-        for (size_t i = 0; i < new_rows; i++) {
-            for (size_t j = 0; j < new_cols; j++) {
-                for (size_t k = 0; k < 4; k++) {
-                    VFType val;
-                    file >> val;
+    for (size_t i = 0; i < new_rows; i++) {
+        for (size_t j = 0; j < new_cols; j++) {
+            for (size_t k = 0; k < D; k++) {
+                VFType val;
+                file >> val;
+                if (keep(i, j)) {
                     velocity.add(i, j, deltas[k].first, deltas[k].second, val, deltas);
                 }
             }
         }
-
-        file >> UT;
-        rows = new_rows;
-        cols = new_cols;
     }
 
+    file >> UT;
+    build_planes();
+    count_dirs();
+
     double default_rho = 0.01;
     rho.resize(256, PType(default_rho));
     std::string line;
@@ -853,3 +1582,37 @@ void FluidSimulator<PType, VType, VFType, N, K>::load_state(const char* filename
     file.close();
 }
 
+
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+std::vector<std::string> FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::layout() const {
+    return field_data;
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::print_frame(std::ostream& out, size_t tick) const {
+    out << "Tick " << tick << ":\n";
+    for (size_t x = 0; x < rows; ++x) {
+        out << field_data[x] << "\n";
+    }
+}
+
+template<typename PType, typename VType, typename VFType, size_t N, size_t K, typename Hood, typename Formats>
+void FluidSimulator<PType, VType, VFType, N, K, Hood, Formats>::set_regions(const std::vector<PackedRegion>& new_regions) {
+    regions = new_regions;
+    region_rnd.assign(regions.size(), std::mt19937(1337));
+    moved_regions.assign(regions.size(), 0);
+    flowing_regions.assign(regions.size(), 1);
+    region_progress.assign(regions.size(), 0);
+    cell_region.assign(rows * cols, 0);
+    for (size_t r = 0; r < regions.size(); ++r) {
+        const auto& region = regions[r];
+        if (region.x0 + region.rows > rows || region.y0 + region.cols > cols) {
+            throw std::runtime_error("Region outside the map");
+        }
+        for (size_t x = region.x0; x < region.x0 + region.rows; ++x) {
+            std::fill_n(cell_region.begin() + x * cols + region.y0, region.cols, static_cast<uint32_t>(r));
+        }
+    }
+    active_rnd = &rnd;
+}
@@ -9,4 +9,11 @@ struct SimulatorFactory {
     static std::unique_ptr<FluidSimulatorBase> create(const std::vector<std::string>& field_data_input) {
         return std::make_unique<FluidSimulator<PType, VType, VFType, N, K>>(field_data_input);
     }
+
+    // A dynamic-extent simulator storing every field at full width,
+    // whatever P_STORAGE, V_STORAGE and VF_STORAGE select.
+    template <typename PType, typename VType, typename VFType>
+    static std::unique_ptr<FluidSimulatorBase> create_full_width(const std::vector<std::string>& field_data_input) {
+        return std::make_unique<FluidSimulator<PType, VType, VFType, 0, 0, NEIGHBOURHOOD, FullStorage>>(field_data_input);
+    }
 };
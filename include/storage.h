@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <ostream>
+#include <istream>
+#include <type_traits>
+#include "fixed.h"
+
+// Storage formats for simulator fields. A field keeps its values in a
+// storage format at rest and widens them to the compute type on load,
+// narrowing again on store. `Full` keeps the compute type itself.
+
+struct Full {};
+
+struct BFloat16 {
+    using RawType = uint16_t;
+
+    static RawType narrow(double d) {
+        float f = static_cast<float>(d);
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        if ((bits & 0x7fffffffu) > 0x7f800000u) {
+            return static_cast<RawType>((bits >> 16) | 0x40u);
+        }
+        bits += 0x7fffu + ((bits >> 16) & 1u);
+        return static_cast<RawType>(bits >> 16);
+    }
+
+    static double widen(RawType r) {
+        uint32_t bits = static_cast<uint32_t>(r) << 16;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+};
+
+struct Half {
+    using RawType = uint16_t;
+
+    static RawType narrow(double d) {
+        float f = static_cast<float>(d);
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000u;
+        uint32_t abs_bits = bits & 0x7fffffffu;
+
+        if (abs_bits >= 0x7f800000u) {
+            return static_cast<RawType>(sign | 0x7c00u | (abs_bits > 0x7f800000u ? 0x200u : 0u));
+        }
+        if (abs_bits >= 0x477ff000u) {
+            return static_cast<RawType>(sign | 0x7c00u);
+        }
+        if (abs_bits < 0x38800000u) {
+            // Subnormal half: scale so that the subnormal step becomes one
+            // and let the FPU round to nearest even.
+            float scaled = std::fabs(f) * 16777216.0f;
+            return static_cast<RawType>(sign | static_cast<uint32_t>(std::nearbyint(scaled)));
+        }
+        uint32_t mant_odd = (abs_bits >> 13) & 1u;
+        abs_bits += 0xc8000fffu + mant_odd;
+        return static_cast<RawType>(sign | (abs_bits >> 13));
+    }
+
+    static double widen(RawType r) {
+        uint32_t sign = static_cast<uint32_t>(r & 0x8000u) << 16;
+        uint32_t exp = (r >> 10) & 0x1fu;
+        uint32_t mant = r & 0x3ffu;
+        float f;
+        if (exp == 0) {
+            f = std::ldexp(static_cast<float>(mant), -24);
+            return sign ? -f : f;
+        }
+        uint32_t bits = exp == 0x1fu
+            ? sign | 0x7f800000u | (mant << 13)
+            : sign | ((exp + 112u) << 23) | (mant << 13);
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+};
+
+template<typename Int, size_t K>
+struct IntFixed {
+    using RawType = Int;
+    static constexpr size_t Fraction = K;
+
+    static RawType narrow(double d) {
+        double scaled = std::nearbyint(d * static_cast<double>(1ULL << K));
+        if (!(scaled > static_cast<double>(std::numeric_limits<Int>::min()))) {
+            return std::numeric_limits<Int>::min();
+        }
+        if (scaled >= static_cast<double>(std::numeric_limits<Int>::max())) {
+            return std::numeric_limits<Int>::max();
+        }
+        return static_cast<RawType>(scaled);
+    }
+
+    static double widen(RawType r) {
+        return static_cast<double>(r) / static_cast<double>(1ULL << K);
+    }
+};
+
+template<size_t K>
+using Int16Fixed = IntFixed<int16_t, K>;
+
+template<size_t K>
+using Int32Fixed = IntFixed<int32_t, K>;
+
+template<typename T>
+double to_double(const T& x) {
+    if constexpr (std::is_arithmetic_v<T>) {
+        return static_cast<double>(x);
+    } else {
+        return static_cast<double>(x.v) / static_cast<double>(1ULL << T::Fraction);
+    }
+}
+
+// Per-field rounding error accumulated on every narrowing store.
+struct StorageErrorStats {
+    double max_abs{0};
+    double sum_sq{0};
+    uint64_t stores{0};
+
+    void record(double err) {
+        err = std::fabs(err);
+        if (err > max_abs) max_abs = err;
+        sum_sq += err * err;
+        ++stores;
+    }
+
+    double rms() const {
+        return stores == 0 ? 0.0 : std::sqrt(sum_sq / static_cast<double>(stores));
+    }
+
+    void print(std::ostream& out, const char* name) const {
+        out << name << " storage error: max " << max_abs
+            << ", rms " << rms() << " over " << stores << " stores\n";
+    }
+};
+
+struct PressureTag {};
+struct VelocityTag {};
+struct VelocityFlowTag {};
+
+template<typename T, typename S, typename Tag>
+class Packed {
+public:
+    using compute_type = T;
+    using RawType = typename S::RawType;
+
+    Packed() : raw(S::narrow(0.0)) {}
+    Packed(const T& value) { store(value); }
+    template<typename U, typename = std::enable_if_t<std::is_arithmetic_v<U>>>
+    Packed(U value) : Packed(T(value)) {}
+
+    operator T() const { return load(); }
+
+    T load() const { return T(S::widen(raw)); }
+
+    void store(const T& value) {
+        double d = to_double(value);
+        raw = S::narrow(d);
+#ifdef STORAGE_STATS
+        stats.record(S::widen(raw) - d);
+#endif
+    }
+
+    Packed& operator=(const T& value) { store(value); return *this; }
+    Packed& operator+=(const T& value) { store(load() + value); return *this; }
+    Packed& operator-=(const T& value) { store(load() - value); return *this; }
+    Packed& operator*=(const T& value) { store(load() * value); return *this; }
+    Packed& operator/=(const T& value) { store(load() / value); return *this; }
+
+    friend std::ostream& operator<<(std::ostream& out, const Packed& x) {
+        return out << x.load();
+    }
+
+    friend std::istream& operator>>(std::istream& in, Packed& x) {
+        T value;
+        in >> value;
+        x.store(value);
+        return in;
+    }
+
+    static inline StorageErrorStats stats{};
+
+private:
+    RawType raw;
+};
+
+template<typename T, typename S, typename Tag>
+struct StoredSelector {
+    using type = Packed<T, S, Tag>;
+};
+
+template<typename T, typename Tag>
+struct StoredSelector<T, Full, Tag> {
+    using type = T;
+};
+
+template<typename T, typename S, typename Tag>
+using Stored = typename StoredSelector<T, S, Tag>::type;
+
+template<typename T>
+struct is_packed : std::false_type {};
+
+template<typename T, typename S, typename Tag>
+struct is_packed<Packed<T, S, Tag>> : std::true_type {};
+
+// Stores are only measured with STORAGE_STATS; without it nothing is
+// printed rather than an error of zero.
+template<typename T>
+void print_storage_stats(std::ostream& out, const char* name) {
+#ifdef STORAGE_STATS
+    if constexpr (is_packed<T>::value) {
+        T::stats.print(out, name);
+    }
+#else
+    (void) out;
+    (void) name;
+#endif
+}
+
+#ifndef P_STORAGE
+#define P_STORAGE Full
+#endif
+
+#ifndef V_STORAGE
+#define V_STORAGE Full
+#endif
+
+#ifndef VF_STORAGE
+#define VF_STORAGE Full
+#endif
+
+// Storage formats of the pressure, velocity and flow fields of one
+// simulator: those configured with P_STORAGE, V_STORAGE and VF_STORAGE,
+// or full width for the reference run that --storage-error compares with.
+template<typename P, typename V, typename VF>
+struct StorageFormats {
+    using Pressure = P;
+    using Velocity = V;
+    using Flow = VF;
+};
+
+using ConfiguredStorage = StorageFormats<P_STORAGE, V_STORAGE, VF_STORAGE>;
+using FullStorage = StorageFormats<Full, Full, Full>;
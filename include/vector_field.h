@@ -3,13 +3,20 @@
 #include <array>
 #include <algorithm>
 #include <cassert>
+#include <stdexcept>
+#include <type_traits>
+#ifdef SPARSE_STORAGE
+#include "block_sparse.h"
+#endif
 
-template<typename T>
+// D velocities per cell, one for each direction of the neighbourhood.
+template<typename T, size_t D = 4>
 class VectorField {
 public:
     using value_type = T;
     using size_type = std::size_t;
-    using delta_array = std::array<std::pair<int, int>, 4>;
+    using delta_array = std::array<std::pair<int, int>, D>;
+    using cell_type = std::array<T, D>;
 
     VectorField() = default;
     VectorField(const VectorField&) = default;
@@ -19,13 +26,11 @@ public:
     ~VectorField() = default;
 
     void init(size_type rows, size_type cols) {
-        v.resize(rows);
-        for(auto& row : v) {
-            row.resize(cols);
-            for(auto& cell : row) {
-                cell.fill(T(0));
-            }
-        }
+        n_rows = rows;
+        n_cols = cols;
+        cell_type zero;
+        zero.fill(T(0));
+        v.assign(rows * cols, zero);
     }
 
     T& add(size_type x, size_type y, int dx, int dy, T dv,
@@ -45,30 +50,28 @@ public:
         
         size_t i = std::distance(deltas.begin(), it);
         assert(i < deltas.size());
-        return v[x][y][i] += dv;
+        return v[x * n_cols + y][i] += dv;
     }
 
     T& get(size_type x, size_type y, int dx, int dy, const delta_array& deltas) {
         size_t i = std::distance(deltas.begin(), std::find(deltas.begin(), deltas.end(), std::make_pair(dx, dy)));
-        return v[x][y][i];
+        return v[x * n_cols + y][i];
     }
 
     void reset() {
-        for(auto& row : v) {
-            for(auto& cell : row) {
-                cell.fill(T(0));
-            }
+        for(auto& cell : v) {
+            cell.fill(T(0));
         }
     }
 
-    const auto& operator[](size_type i) const { 
+    const cell_type* operator[](size_type i) const { 
         assert(i < rows());
-        return v[i]; 
+        return v.data() + i * n_cols; 
     }
     
-    auto& operator[](size_type i) { 
+    cell_type* operator[](size_type i) { 
         assert(i < rows());
-        return v[i]; 
+        return v.data() + i * n_cols; 
     }
 
     static bool is_valid_delta(int dx, int dy, const delta_array& deltas) {
@@ -77,44 +80,48 @@ public:
     }
 
     const T& at(size_type x, size_type y, size_type i) const {
-        assert(is_valid_position(x, y) && i < 4);
-        return v[x][y][i];
+        assert(is_valid_position(x, y) && i < D);
+        return v[x * n_cols + y][i];
     }
 
     T& at(size_type x, size_type y, size_type i) {
-        assert(is_valid_position(x, y) && i < 4);
-        return v[x][y][i];
+        assert(is_valid_position(x, y) && i < D);
+        return v[x * n_cols + y][i];
     }
 
     void swap(VectorField& other) noexcept {
         v.swap(other.v);
+        std::swap(n_rows, other.n_rows);
+        std::swap(n_cols, other.n_cols);
     }
 
-    size_type rows() const { return v.size(); }
-    size_type cols() const { return v.empty() ? 0 : v[0].size(); }
+    size_type rows() const { return n_rows; }
+    size_type cols() const { return n_cols; }
     bool empty() const { return v.empty(); }
     bool is_valid_position(size_type x, size_type y) const {
         return x < rows() && y < cols();
     }
 
-    std::array<T, 4> get_array(size_t x, size_t y) const {
-        return v[x][y];
+    cell_type get_array(size_t x, size_t y) const {
+        return v[x * n_cols + y];
     }
     
-    void set_array(size_t x, size_t y, const std::array<T, 4>& arr) {
-        v[x][y] = arr;
+    void set_array(size_t x, size_t y, const cell_type& arr) {
+        v[x * n_cols + y] = arr;
     }
 
 private:
-    std::vector<std::vector<std::array<T, 4>>> v;
+    size_type n_rows{0}, n_cols{0};
+    std::vector<cell_type> v;
 };
 
-template<typename T, size_t N, size_t K>
+template<typename T, size_t N, size_t K, size_t D = 4>
 class StaticVectorField {
 public:
     using value_type = T;
     using size_type = std::size_t;
-    using delta_array = std::array<std::pair<int, int>, 4>;
+    using delta_array = std::array<std::pair<int, int>, D>;
+    using cell_type = std::array<T, D>;
     
     StaticVectorField() { reset(); }
     StaticVectorField(const StaticVectorField&) = default;
@@ -124,7 +131,8 @@ public:
     ~StaticVectorField() = default;
 
     void init(size_t rows, size_t cols) {
-        v = {};
+        assert(rows <= N && cols <= K);
+        reset();
     }
 
     T& add(size_type x, size_type y, int dx, int dy, T dv,
@@ -159,12 +167,12 @@ public:
     }
 
     const T& at(size_type x, size_type y, size_type i) const {
-        assert(is_valid_position(x, y) && i < 4);
+        assert(is_valid_position(x, y) && i < D);
         return v[x][y][i];
     }
 
     T& at(size_type x, size_type y, size_type i) {
-        assert(is_valid_position(x, y) && i < 4);
+        assert(is_valid_position(x, y) && i < D);
         return v[x][y][i];
     }
 
@@ -182,11 +190,11 @@ public:
         return v[i]; 
     }
 
-    std::array<T, 4> get_array(size_t x, size_t y) const {
+    cell_type get_array(size_t x, size_t y) const {
         return v[x][y];
     }
     
-    void set_array(size_t x, size_t y, const std::array<T, 4>& arr) {
+    void set_array(size_t x, size_t y, const cell_type& arr) {
         v[x][y] = arr;
     }
 
@@ -198,5 +206,232 @@ public:
     }
 
 private:
-    std::array<std::array<std::array<T, 4>, K>, N> v;
-};
\ No newline at end of file
+    std::array<std::array<cell_type, K>, N> v;
+};
+
+// Per-cell velocities with a compile-time width K and a run-time height.
+template<typename T, size_t K, size_t D = 4>
+class WidthVectorField {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using delta_array = std::array<std::pair<int, int>, D>;
+    using cell_type = std::array<T, D>;
+
+    void init(size_type rows, size_type cols) {
+        assert(cols <= K);
+        n_rows = rows;
+        n_cols = cols;
+        cell_type zero;
+        zero.fill(T(0));
+        v.assign(rows * K, zero);
+    }
+
+    T& add(size_type x, size_type y, int dx, int dy, T dv,
+           const delta_array& deltas) {
+        assert(is_valid_position(x, y));
+        size_t i = std::distance(deltas.begin(),
+            std::find(deltas.begin(), deltas.end(), std::make_pair(dx, dy)));
+        assert(i < deltas.size());
+        return v[x * K + y][i] += dv;
+    }
+
+    T& get(size_type x, size_type y, int dx, int dy,
+           const delta_array& deltas) {
+        assert(is_valid_position(x, y));
+        size_t i = std::distance(deltas.begin(),
+            std::find(deltas.begin(), deltas.end(), std::make_pair(dx, dy)));
+        assert(i < deltas.size());
+        return v[x * K + y][i];
+    }
+
+    void reset() {
+        for (auto& cell : v) {
+            cell.fill(T(0));
+        }
+    }
+
+    const T& at(size_type x, size_type y, size_type i) const {
+        assert(is_valid_position(x, y) && i < D);
+        return v[x * K + y][i];
+    }
+
+    T& at(size_type x, size_type y, size_type i) {
+        assert(is_valid_position(x, y) && i < D);
+        return v[x * K + y][i];
+    }
+
+    const cell_type* operator[](size_type i) const {
+        assert(i < n_rows);
+        return v.data() + i * K;
+    }
+
+    cell_type* operator[](size_type i) {
+        assert(i < n_rows);
+        return v.data() + i * K;
+    }
+
+    cell_type get_array(size_t x, size_t y) const {
+        return v[x * K + y];
+    }
+
+    void set_array(size_t x, size_t y, const cell_type& arr) {
+        v[x * K + y] = arr;
+    }
+
+    size_type rows() const { return n_rows; }
+    size_type cols() const { return n_cols; }
+    bool empty() const { return v.empty(); }
+    bool is_valid_position(size_type x, size_type y) const {
+        return x < n_rows && y < n_cols;
+    }
+
+private:
+    size_type n_rows{0}, n_cols{0};
+    std::vector<cell_type> v;
+};
+
+template<typename T>
+class EdgeVectorField {
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using delta_array = std::array<std::pair<int, int>, 4>;
+    using edge_type = std::array<T, 2>;
+
+    EdgeVectorField() = default;
+    EdgeVectorField(const EdgeVectorField&) = default;
+    EdgeVectorField(EdgeVectorField&&) noexcept = default;
+    EdgeVectorField& operator=(const EdgeVectorField&) = default;
+    EdgeVectorField& operator=(EdgeVectorField&&) noexcept = default;
+    ~EdgeVectorField() = default;
+
+    // Edge (x, y) of x_edges lies between cells (x - 1, y) and (x, y);
+    // edge (x, y) of y_edges lies between cells (x, y - 1) and (x, y).
+    // Slot 0 is the velocity of the lower-index cell towards the edge,
+    // slot 1 the velocity of the higher-index cell towards it.
+    void init(size_type rows, size_type cols) {
+        n_rows = rows;
+        n_cols = cols;
+        x_edges.assign((rows + 1) * cols, edge_type{T(0), T(0)});
+        y_edges.assign(rows * (cols + 1), edge_type{T(0), T(0)});
+    }
+
+    T& add(size_type x, size_type y, int dx, int dy, T dv,
+           const delta_array& deltas) {
+        assert(is_valid_position(x, y));
+        if (!is_valid_delta(dx, dy, deltas)) {
+            throw std::runtime_error("Invalid delta values");
+        }
+        return slot(x, y, dx, dy) += dv;
+    }
+
+    T& get(size_type x, size_type y, int dx, int dy, const delta_array& deltas) {
+        assert(is_valid_position(x, y) && is_valid_delta(dx, dy, deltas));
+        return slot(x, y, dx, dy);
+    }
+
+    void reset() {
+        std::fill(x_edges.begin(), x_edges.end(), edge_type{T(0), T(0)});
+        std::fill(y_edges.begin(), y_edges.end(), edge_type{T(0), T(0)});
+    }
+
+    static bool is_valid_delta(int dx, int dy, const delta_array& deltas) {
+        return std::find(deltas.begin(), deltas.end(),
+                        std::make_pair(dx, dy)) != deltas.end();
+    }
+
+    const T& at(size_type x, size_type y, size_type i) const {
+        assert(is_valid_position(x, y) && i < 4);
+        return const_cast<EdgeVectorField*>(this)->slot(x, y, i);
+    }
+
+    T& at(size_type x, size_type y, size_type i) {
+        assert(is_valid_position(x, y) && i < 4);
+        return slot(x, y, i);
+    }
+
+    edge_type& x_edge(size_type x, size_type y) { return x_edges[x * n_cols + y]; }
+    edge_type& y_edge(size_type x, size_type y) { return y_edges[x * (n_cols + 1) + y]; }
+    const edge_type& x_edge(size_type x, size_type y) const { return x_edges[x * n_cols + y]; }
+    const edge_type& y_edge(size_type x, size_type y) const { return y_edges[x * (n_cols + 1) + y]; }
+
+    void swap(EdgeVectorField& other) noexcept {
+        x_edges.swap(other.x_edges);
+        y_edges.swap(other.y_edges);
+        std::swap(n_rows, other.n_rows);
+        std::swap(n_cols, other.n_cols);
+    }
+
+    size_type rows() const { return n_rows; }
+    size_type cols() const { return n_cols; }
+    bool empty() const { return n_rows == 0 || n_cols == 0; }
+    bool is_valid_position(size_type x, size_type y) const {
+        return x < rows() && y < cols();
+    }
+
+    std::array<T, 4> get_array(size_t x, size_t y) const {
+        return {at(x, y, 0), at(x, y, 1), at(x, y, 2), at(x, y, 3)};
+    }
+
+    void set_array(size_t x, size_t y, const std::array<T, 4>& arr) {
+        for (size_t i = 0; i < 4; ++i) {
+            at(x, y, i) = arr[i];
+        }
+    }
+
+private:
+    // Direction indices follow the simulator's deltas order:
+    // (-1, 0), (1, 0), (0, -1), (0, 1).
+    T& slot(size_type x, size_type y, size_type i) {
+        switch (i) {
+            case 0: return x_edge(x, y)[1];
+            case 1: return x_edge(x + 1, y)[0];
+            case 2: return y_edge(x, y)[1];
+            default: return y_edge(x, y + 1)[0];
+        }
+    }
+
+    T& slot(size_type x, size_type y, int dx, int dy) {
+        if (dx != 0) {
+            return dx < 0 ? x_edge(x, y)[1] : x_edge(x + 1, y)[0];
+        }
+        return dy < 0 ? y_edge(x, y)[1] : y_edge(x, y + 1)[0];
+    }
+
+    size_type n_rows{0}, n_cols{0};
+    std::vector<edge_type> x_edges;
+    std::vector<edge_type> y_edges;
+};
+
+// Per-cell storage of the dynamic-extent engine; block-sparse with
+// SPARSE_STORAGE.
+#ifdef SPARSE_STORAGE
+template<typename T, size_t D = 4>
+using CellVectorField = SparseVectorField<T, D>;
+#else
+template<typename T, size_t D = 4>
+using CellVectorField = VectorField<T, D>;
+#endif
+
+// Edge storage covers the four edge directions only; other
+// neighbourhoods keep per-cell storage.
+#ifdef EDGE_VELOCITY
+template<typename T, size_t D = 4>
+using VelocityField = std::conditional_t<D == 4, EdgeVectorField<T>, CellVectorField<T, D>>;
+#else
+template<typename T, size_t D = 4>
+using VelocityField = CellVectorField<T, D>;
+#endif
+
+// Per-cell velocities in static storage when both extents are known at
+// compile time, with a constant stride when only the width K is. Edge
+// storage has no static variant and stays dynamic.
+#ifdef EDGE_VELOCITY
+template<typename T, size_t N, size_t K, size_t D = 4>
+using ExtentVelocityField = VelocityField<T, D>;
+#else
+template<typename T, size_t N, size_t K, size_t D = 4>
+using ExtentVelocityField = std::conditional_t<(N > 0 && K > 0), StaticVectorField<T, N, K, D>,
+                            std::conditional_t<(K > 0), WidthVectorField<T, K, D>, VelocityField<T, D>>>;
+#endif
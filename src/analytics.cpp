@@ -0,0 +1,71 @@
+#include "analytics.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+namespace analytics {
+    StatsWriter::StatsWriter(const std::string& path, bool binary, const std::vector<std::string>& field_data)
+        : out(path, binary ? std::ios::binary : std::ios::out), binary(binary) {
+        if (!out.is_open()) {
+            throw std::runtime_error("Error opening stats file: " + path);
+        }
+
+        for (size_t x = 0; x < field_data.size(); ++x) {
+            size_t open = 0;
+            for (char c : field_data[x]) {
+                if (c == '#') continue;
+                ++open;
+                if (materials.find(c) == std::string::npos) {
+                    materials.push_back(c);
+                }
+            }
+            if (open > 0) {
+                outlet_row = x;
+                outlet_cells = open;
+            }
+        }
+        std::sort(materials.begin(), materials.end());
+
+        std::vector<std::string> columns{"tick"};
+        for (char c : materials) {
+            columns.push_back(std::string("mass[") + c + "]");
+        }
+        columns.insert(columns.end(), {"com_x", "com_y", "kinetic", "outlet_fill"});
+        row.resize(columns.size());
+
+        if (binary) {
+            out.write("FSTS", 4);
+            uint32_t count = static_cast<uint32_t>(columns.size());
+            out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            for (const auto& column : columns) {
+                out.write(column.c_str(), static_cast<std::streamsize>(column.size() + 1));
+            }
+        } else {
+            for (size_t i = 0; i < columns.size(); ++i) {
+                out << (i ? "," : "") << columns[i];
+            }
+            out << "\n";
+        }
+    }
+
+    void StatsWriter::write(size_t tick, const FieldStats& stats) {
+        size_t i = 0;
+        row[i++] = static_cast<double>(tick);
+        for (char c : materials) {
+            row[i++] = stats.mass[static_cast<unsigned char>(c)];
+        }
+        row[i++] = stats.total_mass > 0 ? stats.weighted_x / stats.total_mass : 0.0;
+        row[i++] = stats.total_mass > 0 ? stats.weighted_y / stats.total_mass : 0.0;
+        row[i++] = stats.kinetic;
+        row[i++] = outlet_cells > 0 ? static_cast<double>(stats.outlet_fluid) / static_cast<double>(outlet_cells) : 0.0;
+
+        if (binary) {
+            out.write(reinterpret_cast<const char*>(row.data()), static_cast<std::streamsize>(row.size() * sizeof(double)));
+        } else {
+            for (size_t j = 0; j < row.size(); ++j) {
+                out << (j ? "," : "") << row[j];
+            }
+            out << "\n";
+        }
+    }
+}
@@ -0,0 +1,178 @@
+#include "fuzz.h"
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fuzz {
+    static const char* objective_names[OBJECTIVES] = {"tick_time", "flow_sweeps", "move_depth"};
+
+    static double objectiveValue(const Score& score, size_t objective) {
+        switch (static_cast<Objective>(objective)) {
+            case Objective::TickTime: return score.tick_ms;
+            case Objective::FlowSweeps: return static_cast<double>(score.flow_sweeps);
+            case Objective::MoveDepth: return static_cast<double>(score.move_depth) + score.depth_limit_hit;
+        }
+        return 0;
+    }
+
+    static std::string formatNumber(double value) {
+        std::ostringstream out;
+        out << value;
+        return out.str();
+    }
+
+    std::vector<std::string> mutateMap(const std::vector<std::string>& map, std::mt19937& rnd) {
+        std::vector<std::string> result = map;
+        size_t rows = 0, cols = 0;
+        if (!map.empty()) {
+            std::stringstream(map[0]) >> rows >> cols;
+        }
+        if (rows < 3 || cols < 3 || map.size() < 2 + rows) {
+            throw std::runtime_error("Map too small to mutate");
+        }
+        for (size_t x = 0; x < rows; ++x) {
+            if (map[2 + x].size() < cols) {
+                throw std::runtime_error("Map has a short row");
+            }
+        }
+
+        auto pick = [&](size_t lo, size_t hi) {
+            return std::uniform_int_distribution<size_t>(lo, hi)(rnd);
+        };
+        auto scale = [&](double lo, double hi) {
+            return std::uniform_real_distribution<double>(lo, hi)(rnd);
+        };
+        auto cell = [&](size_t x, size_t y) -> char& { return result[2 + x][y]; };
+
+        std::string materials = " ";
+        for (size_t x = 0; x < rows; ++x) {
+            for (char c : map[2 + x].substr(0, cols)) {
+                if (c != '#' && materials.find(c) == std::string::npos) {
+                    materials.push_back(c);
+                }
+            }
+        }
+        std::vector<size_t> density_lines;
+        for (size_t i = 2 + rows; i < map.size(); ++i) {
+            if (map[i].find('=') != std::string::npos) {
+                density_lines.push_back(i);
+            }
+        }
+
+        size_t kind = pick(0, 5);
+        if (kind == 5 && density_lines.empty()) {
+            kind = 4;
+        }
+        switch (kind) {
+            case 0: {
+                char& c = cell(pick(1, rows - 2), pick(1, cols - 2));
+                c = c == '#' ? ' ' : '#';
+                break;
+            }
+            case 1: {
+                // A straight wall, the usual way long chains and slow flow
+                // appear: channels and pockets.
+                size_t x = pick(1, rows - 2), y = pick(1, cols - 2);
+                bool vertical = pick(0, 1);
+                size_t length = pick(1, std::max<size_t>(1, (vertical ? rows : cols) / 4));
+                for (size_t i = 0; i < length; ++i) {
+                    size_t cx = vertical ? x + i : x, cy = vertical ? y : y + i;
+                    if (cx > rows - 2 || cy > cols - 2) break;
+                    cell(cx, cy) = '#';
+                }
+                break;
+            }
+            case 2: {
+                char material = materials[pick(0, materials.size() - 1)];
+                size_t x = pick(1, rows - 2), y = pick(1, cols - 2);
+                size_t height = pick(1, 8), width = pick(1, 8);
+                for (size_t cx = x; cx < std::min(x + height, rows - 1); ++cx) {
+                    for (size_t cy = y; cy < std::min(y + width, cols - 1); ++cy) {
+                        cell(cx, cy) = material;
+                    }
+                }
+                break;
+            }
+            case 3:
+                std::swap(cell(pick(1, rows - 2), pick(1, cols - 2)), cell(pick(1, rows - 2), pick(1, cols - 2)));
+                break;
+            case 4:
+                result[1] = formatNumber(std::stod(map[1]) * scale(0.5, 2.0));
+                break;
+            case 5: {
+                size_t line = density_lines[pick(0, density_lines.size() - 1)];
+                const std::string& text = map[line];
+                double value = std::stod(text.substr(text.find('=') + 1));
+                result[line] = text.substr(0, 1) + " = " + formatNumber(value * scale(0.1, 10.0));
+                break;
+            }
+        }
+        return result;
+    }
+
+    std::vector<Score> search(const std::vector<std::string>& seed, size_t iterations,
+                              const std::string& corpus_dir, unsigned seed_value,
+                              const std::function<Score(const std::vector<std::string>&)>& evaluate) {
+        std::filesystem::create_directories(corpus_dir);
+        std::mt19937 rnd(seed_value);
+
+        Score seed_score = evaluate(seed);
+        std::array<std::vector<std::string>, OBJECTIVES> worst;
+        std::array<Score, OBJECTIVES> worst_scores;
+        worst.fill(seed);
+        worst_scores.fill(seed_score);
+
+        auto write = [&](const std::string& name, const std::vector<std::string>& map) {
+            std::string path = corpus_dir + "/" + name + ".txt";
+            std::ofstream out(path);
+            if (!out.is_open()) {
+                throw std::runtime_error("Error opening corpus file: " + path);
+            }
+            for (const auto& line : map) {
+                out << line << "\n";
+            }
+        };
+        auto save = [&](size_t objective) {
+            write(std::string("worst_") + objective_names[objective], worst[objective]);
+        };
+        for (size_t objective = 0; objective < OBJECTIVES; ++objective) {
+            save(objective);
+        }
+        {
+            std::ofstream list(corpus_dir + "/corpus.lst");
+            for (size_t objective = 0; objective < OBJECTIVES; ++objective) {
+                list << corpus_dir << "/worst_" << objective_names[objective] << ".txt\n";
+            }
+        }
+
+        for (size_t iteration = 0; iteration < iterations; ++iteration) {
+            size_t parent = iteration % OBJECTIVES;
+            std::vector<std::string> candidate = mutateMap(worst[parent], rnd);
+            // Left behind if the candidate never finishes, so that a map
+            // that hangs the engine can be reproduced.
+            write("in_progress", candidate);
+            Score score;
+            try {
+                score = evaluate(candidate);
+            } catch (const std::exception&) {
+                // Rejected by the engine; not a map worth keeping.
+                continue;
+            }
+            for (size_t objective = 0; objective < OBJECTIVES; ++objective) {
+                double value = objectiveValue(score, objective);
+                if (value > objectiveValue(worst_scores[objective], objective)) {
+                    worst[objective] = candidate;
+                    worst_scores[objective] = score;
+                    save(objective);
+                    std::cout << "Iteration " << iteration + 1 << ": worst " << objective_names[objective]
+                              << " now " << value << std::endl;
+                }
+            }
+        }
+        return std::vector<Score>(worst_scores.begin(), worst_scores.end());
+    }
+}
@@ -0,0 +1,291 @@
+// Benchmarks the input and output paths of the simulator: reading a map
+// file, parsing it into a simulator (initialize_field), saving and loading
+// a snapshot, and printing a frame with the simulator's print_frame.
+// Every path runs on generated maps of several sizes and kinds, and every
+// path that touches a file runs with the page cache cold and warm. Results are written as JSON in the layout
+// of Google Benchmark's --benchmark_format=json, one entry per path, map
+// and cache state.
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <filesystem>
+#include <functional>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "simulator.h"
+#include "config.h"
+#include "utils.h"
+
+namespace {
+    // Discards what is written to it, after the stream has formatted it,
+    // so the parse and frame timings include formatting but no terminal.
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override { return c; }
+        std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    struct Result {
+        std::string name;
+        size_t iterations{0};
+        double median_ms{0};
+        double min_ms{0};
+        size_t bytes{0};
+    };
+
+    // A walled map of one of the kinds: "empty" holds only air, "dense"
+    // has its lower half filled with fluid, and "maze" scatters walls and
+    // two materials at random.
+    std::vector<std::string> generateMap(const std::string& kind, size_t rows, size_t cols) {
+        std::vector<std::string> map{std::to_string(rows) + " " + std::to_string(cols), "0.1"};
+        std::mt19937 rnd(1337);
+        std::uniform_int_distribution<int> percent(0, 99);
+        for (size_t x = 0; x < rows; ++x) {
+            std::string row(cols, ' ');
+            for (size_t y = 0; y < cols; ++y) {
+                if (x == 0 || y == 0 || x + 1 == rows || y + 1 == cols) {
+                    row[y] = '#';
+                } else if (kind == "dense") {
+                    row[y] = x >= rows / 2 ? '.' : ' ';
+                } else if (kind == "maze") {
+                    int r = percent(rnd);
+                    row[y] = r < 25 ? '#' : r < 50 ? '.' : r < 60 ? '+' : ' ';
+                } else if (kind != "empty") {
+                    throw std::runtime_error("Unknown map kind: " + kind);
+                }
+            }
+            map.push_back(row);
+        }
+        map.push_back("  = 0.01");
+        map.push_back(". = 1000");
+        map.push_back("+ = 500");
+        return map;
+    }
+
+    void writeLines(const std::string& path, const std::vector<std::string>& lines) {
+        std::ofstream out(path);
+        if (!out.is_open()) {
+            throw std::runtime_error("Error opening file: " + path);
+        }
+        for (const auto& line : lines) {
+            out << line << "\n";
+        }
+    }
+
+    // Writes the file's dirty pages and asks the kernel to drop its cached
+    // pages, so that the next read comes from the device.
+    void dropFromCache(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Error opening file: " + path);
+        }
+        fsync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    void syncFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Error opening file: " + path);
+        }
+        fsync(fd);
+        close(fd);
+    }
+
+    // Times `body` `repeat` times after one untimed run; `prepare` runs
+    // untimed before each timed run.
+    Result measure(const std::string& name, size_t repeat, size_t bytes,
+                   const std::function<void()>& prepare, const std::function<void()>& body) {
+        std::vector<double> times;
+        prepare();
+        body();
+        for (size_t i = 0; i < repeat; ++i) {
+            prepare();
+            auto start = std::chrono::steady_clock::now();
+            body();
+            times.push_back(std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(times.begin(), times.end());
+        return {name, repeat, times[times.size() / 2], times.front(), bytes};
+    }
+
+    std::string jsonEscape(const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\') escaped.push_back('\\');
+            escaped.push_back(c);
+        }
+        return escaped;
+    }
+
+    void writeJson(std::ostream& out, const char* executable, const std::string& types,
+                   const std::vector<Result>& results) {
+        std::time_t now = std::time(nullptr);
+        char date[64];
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+        out << "{\n"
+            << "  \"context\": {\n"
+            << "    \"date\": \"" << date << "\",\n"
+            << "    \"executable\": \"" << jsonEscape(executable) << "\",\n"
+            << "    \"types\": \"" << jsonEscape(types) << "\"\n"
+            << "  },\n"
+            << "  \"benchmarks\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& r = results[i];
+            double bytes_per_second = r.median_ms > 0 ? r.bytes / (r.median_ms / 1000.0) : 0.0;
+            out << "    {\n"
+                << "      \"name\": \"" << jsonEscape(r.name) << "\",\n"
+                << "      \"run_name\": \"" << jsonEscape(r.name) << "\",\n"
+                << "      \"run_type\": \"iteration\",\n"
+                << "      \"iterations\": " << r.iterations << ",\n"
+                << "      \"real_time\": " << r.median_ms << ",\n"
+                << "      \"min_time\": " << r.min_ms << ",\n"
+                << "      \"time_unit\": \"ms\",\n"
+                << "      \"bytes\": " << r.bytes << ",\n"
+                << "      \"bytes_per_second\": " << bytes_per_second << "\n"
+                << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* p_type_str = "FIXED(32,16)";
+    const char* v_type_str = "FIXED(32,16)";
+    const char* vf_type_str = "FIXED(32,16)";
+    const char* out_path = nullptr;
+    std::string sizes = "36x84,256x256,1024x1024";
+    std::string kinds = "empty,dense,maze";
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "fluid_io_benchmark";
+    size_t repeat = 5;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--p-type" && i + 1 < argc) {
+            p_type_str = argv[++i];
+        } else if (arg == "--v-type" && i + 1 < argc) {
+            v_type_str = argv[++i];
+        } else if (arg == "--v-flow-type" && i + 1 < argc) {
+            vf_type_str = argv[++i];
+        } else if (arg == "--sizes" && i + 1 < argc) {
+            sizes = argv[++i];
+        } else if (arg == "--kinds" && i + 1 < argc) {
+            kinds = argv[++i];
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::stoi(argv[++i]);
+        } else if (arg == "--dir" && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (arg == "--out" && i + 1 < argc) {
+            out_path = argv[++i];
+        }
+    }
+
+    try {
+        if (repeat == 0) {
+            throw std::runtime_error("--repeat must be positive");
+        }
+        std::filesystem::create_directories(dir);
+        std::vector<Result> results;
+        NullBuffer null_buffer;
+
+        std::stringstream size_list(sizes);
+        std::string size;
+        while (std::getline(size_list, size, ',')) {
+            size_t rows = 0, cols = 0;
+            char x = 0;
+            if (!(std::stringstream(size) >> rows >> x >> cols) || x != 'x' || rows < 3 || cols < 3) {
+                throw std::runtime_error("Invalid size: " + size);
+            }
+            std::stringstream kind_list(kinds);
+            std::string kind;
+            while (std::getline(kind_list, kind, ',')) {
+                const std::string label = kind + "/" + size;
+                const std::string map_path = (dir / (kind + "_" + size + ".txt")).string();
+                const std::string state_path = (dir / (kind + "_" + size + ".state")).string();
+                const std::string frame_path = (dir / (kind + "_" + size + ".frame")).string();
+                auto map = generateMap(kind, rows, cols);
+                writeLines(map_path, map);
+                size_t map_bytes = std::filesystem::file_size(map_path);
+
+                // The simulator prints the map and its state while it
+                // parses; that output goes to the null buffer.
+                std::streambuf* console = std::cout.rdbuf(&null_buffer);
+                std::unique_ptr<FluidSimulatorBase> simulator;
+                try {
+                    simulator = createSimulatorInstance(map, p_type_str, v_type_str, vf_type_str);
+                    simulator->save_state(state_path.c_str());
+                    size_t state_bytes = std::filesystem::file_size(state_path);
+                    std::ostringstream frame_text;
+                    simulator->print_frame(frame_text, 0);
+                    size_t frame_bytes = frame_text.str().size();
+                    auto nothing = [] {};
+
+                    for (bool cold : {true, false}) {
+                        const std::string cache = cold ? "/cold" : "/warm";
+                        auto drop_map = [&] { if (cold) dropFromCache(map_path); };
+                        auto drop_state = [&] { if (cold) dropFromCache(state_path); };
+
+                        results.push_back(measure("read" + cache + "/" + label, repeat, map_bytes, drop_map, [&] {
+                            utils::readFieldFromFile(map_path.c_str());
+                        }));
+                        results.push_back(measure("load_state" + cache + "/" + label, repeat, state_bytes, drop_state, [&] {
+                            simulator->load_state(state_path.c_str());
+                        }));
+                        // A cold write is one that reaches the device, so
+                        // it includes the fsync.
+                        results.push_back(measure("save_state" + cache + "/" + label, repeat, state_bytes, nothing, [&] {
+                            simulator->save_state(state_path.c_str());
+                            if (cold) syncFile(state_path);
+                        }));
+                        results.push_back(measure("frame" + cache + "/" + label, repeat, frame_bytes, nothing, [&] {
+                            std::ofstream frame(frame_path);
+                            simulator->print_frame(frame, 0);
+                            frame.close();
+                            if (cold) syncFile(frame_path);
+                        }));
+                    }
+                    // Parsing works on lines already in memory, so it has
+                    // no cache state.
+                    results.push_back(measure("initialize_field/" + label, repeat, map_bytes, nothing, [&] {
+                        createSimulatorInstance(map, p_type_str, v_type_str, vf_type_str);
+                    }));
+                } catch (...) {
+                    std::cout.rdbuf(console);
+                    throw;
+                }
+                std::cout.rdbuf(console);
+                std::cerr << "Measured " << label << "\n";
+
+                std::filesystem::remove(map_path);
+                std::filesystem::remove(state_path);
+                std::filesystem::remove(frame_path);
+            }
+        }
+
+        std::string types = std::string(p_type_str) + "," + v_type_str + "," + vf_type_str;
+        if (out_path) {
+            std::ofstream out(out_path);
+            if (!out.is_open()) {
+                throw std::runtime_error("Error opening file: " + std::string(out_path));
+            }
+            writeJson(out, argv[0], types, results);
+        } else {
+            writeJson(std::cout, argv[0], types, results);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -5,19 +5,34 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 
 #include "simulator.h"
 #include "config.h"
 #include "utils.h"
+#include "preview.h"
+#include "packing.h"
+#include "fuzz.h"
 #include "macros.h"
 
 int main(int argc, char* argv[]) {
     const char* filename = "../data/default.txt";
+    const char* scenario = nullptr;
+    const char* pack_list = nullptr;
+    const char* fuzz_corpus = "fuzz_corpus";
+    size_t fuzz_iterations = 0;
+    unsigned fuzz_seed = 1;
     const char* p_type_str = "FIXED(32,16)";
     const char* v_type_str = "FIXED(32,16)";
     const char* vf_type_str = "FIXED(32,16)";
     size_t steps = 10000;
     size_t checkpoint_interval = 1;
+    size_t preview_factor = 0;
+    bool warm_start = false;
+    bool verify_static = false;
+    bool storage_error = false;
+    ExtentMode extent_mode = ExtentMode::Auto;
+    SimulatorOptions options;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -30,21 +45,276 @@ int main(int argc, char* argv[]) {
             vf_type_str = argv[++i];
         } else if (arg == "--file" && i + 1 < argc) {
             filename = argv[++i];
+        } else if (arg == "--scenario" && i + 1 < argc) {
+            scenario = argv[++i];
+        } else if (arg == "--pack" && i + 1 < argc) {
+            pack_list = argv[++i];
+        } else if (arg == "--fuzz" && i + 1 < argc) {
+            fuzz_iterations = std::stoi(argv[++i]);
+        } else if (arg == "--fuzz-corpus" && i + 1 < argc) {
+            fuzz_corpus = argv[++i];
+        } else if (arg == "--fuzz-seed" && i + 1 < argc) {
+            fuzz_seed = std::stoi(argv[++i]);
         } else if (arg == "--steps" && i + 1 < argc) {
             steps = std::stoi(argv[++i]);
         } else if (arg == "--checkpoint" && i + 1 < argc) {
             checkpoint_interval = std::stoi(argv[++i]);
+        } else if (arg == "--preview" && i + 1 < argc) {
+            preview_factor = std::stoi(argv[++i]);
+        } else if (arg == "--warm-start") {
+            warm_start = true;
+        } else if (arg == "--compat-rng") {
+            options.compat_rng = true;
+        } else if (arg == "--flow-sweeps" && i + 1 < argc) {
+            options.max_flow_sweeps = std::stoi(argv[++i]);
+        } else if (arg == "--flow-min-gain" && i + 1 < argc) {
+            options.min_flow_gain = std::stod(argv[++i]);
+        } else if (arg == "--flow-residual") {
+            options.measure_flow_residual = true;
+        } else if (arg == "--material-order") {
+            options.material_order = true;
+        } else if (arg == "--frontier-stop") {
+            options.frontier_stop = true;
+        } else if (arg == "--stats" && i + 1 < argc) {
+            options.stats_path = argv[++i];
+        } else if (arg == "--stats-every" && i + 1 < argc) {
+            options.stats_interval = std::stoi(argv[++i]);
+        } else if (arg == "--stats-binary") {
+            options.stats_binary = true;
+        } else if (arg == "--dynamic-extent") {
+            extent_mode = ExtentMode::Dynamic;
+        } else if (arg == "--width-extent") {
+            extent_mode = ExtentMode::Width;
+        } else if (arg == "--verify-static") {
+            verify_static = true;
+        } else if (arg == "--storage-error") {
+            storage_error = true;
         }
     }
 
     try {
+        if (options.stats_interval == 0) {
+            throw std::runtime_error("--stats-every must be positive");
+        }
         auto start = std::chrono::high_resolution_clock::now();
 
-        std::vector<std::string> field_data_input = utils::readFieldFromFile(filename);
+        // Many small maps run as one packed simulation. Every map keeps
+        // its own step count, advancing two steps on a tick it moved in as
+        // run() does, and its layout is taken once its steps are used up.
+        if (pack_list) {
+            std::vector<std::string> names;
+            for (const auto& line : utils::readFieldFromFile(pack_list)) {
+                if (!line.empty()) names.push_back(line);
+            }
+            std::vector<std::vector<std::string>> maps;
+            for (const auto& name : names) {
+                maps.push_back(utils::readFieldFromFile(name.c_str()));
+            }
+
+            std::vector<std::vector<std::string>> results(maps.size());
+            std::vector<size_t> ticks(maps.size(), 0);
+            auto packs = packing::packMaps(maps);
+            for (size_t pack_index = 0; pack_index < packs.size(); ++pack_index) {
+                const auto& pack = packs[pack_index];
+                auto simulator = createSimulatorInstance(
+                    pack.field_data, p_type_str, v_type_str, vf_type_str, extent_mode
+                );
+                // Every pack is a simulation of its own, so each writes
+                // its statistics to its own file.
+                SimulatorOptions pack_options = options;
+                if (!pack_options.stats_path.empty()) {
+                    pack_options.stats_path += "." + std::to_string(pack_index);
+                }
+                simulator->set_options(pack_options);
+                simulator->set_regions(pack.regions);
+
+                auto layout = simulator->layout();
+                std::vector<size_t> region_steps(pack.regions.size(), 0);
+                for (size_t r = 0; r < pack.regions.size(); ++r) {
+                    results[pack.sources[r]] = packing::unpackLayout(pack, r, layout);
+                }
+                size_t running = steps > 0 ? pack.regions.size() : 0;
+                while (running > 0) {
+                    simulator->tick();
+                    const auto& moved = simulator->region_moved();
+                    layout.clear();
+                    for (size_t r = 0; r < pack.regions.size(); ++r) {
+                        if (region_steps[r] >= steps) continue;
+                        ++ticks[pack.sources[r]];
+                        region_steps[r] += 1 + moved[r];
+                        if (region_steps[r] >= steps) {
+                            if (layout.empty()) layout = simulator->layout();
+                            results[pack.sources[r]] = packing::unpackLayout(pack, r, layout);
+                            --running;
+                        }
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < maps.size(); ++i) {
+                std::cout << "Map " << names[i] << " after " << ticks[i] << " ticks:\n";
+                for (const auto& row : results[i]) {
+                    std::cout << row << "\n";
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            std::cout << "Simulation took " << duration.count() << " ms\n";
+            return 0;
+        }
+
+        // Searches for maps that are slow to simulate, starting from the
+        // map given with --file. Every candidate runs for --steps ticks
+        // with its output discarded.
+        if (fuzz_iterations > 0) {
+            SimulatorOptions fuzz_options = options;
+            fuzz_options.stats_path.clear();
+            // Some maps never settle their flow; without a bound a single
+            // candidate would stall the search. Reaching it is the worst
+            // flow result.
+            if (fuzz_options.max_flow_sweeps == 0) {
+                fuzz_options.max_flow_sweeps = 10000;
+            }
+            auto evaluate = [&](const std::vector<std::string>& map) {
+                std::streambuf* out = std::cout.rdbuf(nullptr);
+                fuzz::Score score;
+                try {
+                    auto simulator = createSimulatorInstance(map, p_type_str, v_type_str, vf_type_str, extent_mode);
+                    simulator->set_options(fuzz_options);
+                    double total_ms = 0;
+                    for (size_t step = 0; step < steps; ++step) {
+                        auto tick_start = std::chrono::steady_clock::now();
+                        simulator->tick();
+                        total_ms += std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - tick_start).count();
+                        const TickCost& cost = simulator->last_tick_cost();
+                        score.flow_sweeps = std::max(score.flow_sweeps, cost.flow_sweeps);
+                        score.move_depth = std::max(score.move_depth, cost.move_depth);
+                        score.depth_limit_hit |= cost.depth_limit_hit;
+                    }
+                    score.tick_ms = steps > 0 ? total_ms / steps : 0.0;
+                } catch (...) {
+                    std::cout.rdbuf(out);
+                    throw;
+                }
+                std::cout.rdbuf(out);
+                return score;
+            };
+
+            auto worst = fuzz::search(utils::readFieldFromFile(filename), fuzz_iterations,
+                                      fuzz_corpus, fuzz_seed, evaluate);
+            std::cout << "Worst tick time: " << worst[0].tick_ms << " ms per tick\n"
+                      << "Most flow sweeps: " << worst[1].flow_sweeps << " in a tick"
+                      << (worst[1].flow_sweeps >= fuzz_options.max_flow_sweeps ? " (sweep limit hit)" : "") << "\n"
+                      << "Deepest move chain: " << worst[2].move_depth
+                      << (worst[2].depth_limit_hit ? " (recursion limit hit)" : "") << "\n"
+                      << "Corpus written to " << fuzz_corpus << "\n";
+            return 0;
+        }
+
+        // An embedded scenario skips parsing unless the map is needed as
+        // text, for a preview or a side-by-side check.
+        if (scenario && preview_factor == 0 && !verify_static) {
+            auto simulator = createScenarioInstance(scenario, p_type_str, v_type_str, vf_type_str);
+            simulator->set_options(options);
+            simulator->run(steps, checkpoint_interval);
+            auto end = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            std::cout << "Simulation took " << duration.count() << " ms\n";
+            return 0;
+        }
+
+        std::vector<std::string> field_data_input =
+            scenario ? embedded_map_lines(scenario) : utils::readFieldFromFile(filename);
+
+        if (preview_factor > 0) {
+            std::unique_ptr<FluidSimulatorBase> coarse = createSimulatorInstance(
+                preview::downsampleField(field_data_input, preview_factor), p_type_str, v_type_str, vf_type_str
+            );
+            coarse->set_options(options);
+            coarse->run(steps, checkpoint_interval);
+            auto coarse_layout = coarse->layout();
+            preview::printReport(std::cout, field_data_input, coarse_layout, preview_factor);
+            if (!warm_start) {
+                auto end = std::chrono::high_resolution_clock::now();
+                auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+                std::cout << "Preview took " << duration.count() << " ms\n";
+                return 0;
+            }
+            field_data_input = preview::upsampleField(field_data_input, coarse_layout, preview_factor);
+        }
+
+        if (verify_static) {
+            auto reference = createSimulatorInstance(
+                field_data_input, p_type_str, v_type_str, vf_type_str, ExtentMode::Dynamic
+            );
+            auto candidate = createSimulatorInstance(
+                field_data_input, p_type_str, v_type_str, vf_type_str,
+                extent_mode == ExtentMode::Width ? ExtentMode::Width : ExtentMode::Static
+            );
+            SimulatorOptions candidate_options = options;
+            candidate_options.stats_path.clear();
+            reference->set_options(options);
+            candidate->set_options(candidate_options);
+            for (size_t step = 0; step < steps; ++step) {
+                reference->tick();
+                candidate->tick();
+                if (reference->state_hash() != candidate->state_hash()) {
+                    std::cout << "Static engine diverged at tick " << step + 1 << "\n";
+                    return 1;
+                }
+            }
+            std::cout << "Static engine matched for " << steps << " ticks\n";
+            return 0;
+        }
+
+        // Runs the configured storage formats and full-width storage side
+        // by side and reports how far their fields drift apart, over every
+        // value of every tick.
+        if (storage_error) {
+            auto reference = createFullWidthInstance(field_data_input, p_type_str, v_type_str, vf_type_str);
+            auto candidate = createSimulatorInstance(
+                field_data_input, p_type_str, v_type_str, vf_type_str, extent_mode
+            );
+            SimulatorOptions reference_options = options;
+            reference_options.stats_path.clear();
+            reference->set_options(reference_options);
+            candidate->set_options(options);
+            StorageErrorStats pressure, velocity;
+            size_t cells_differing = 0, most_cells_differing = 0;
+            for (size_t step = 0; step < steps; ++step) {
+                reference->tick();
+                candidate->tick();
+                FieldValues exact = reference->field_values();
+                FieldValues reduced = candidate->field_values();
+                for (size_t i = 0; i < exact.pressure.size(); ++i) {
+                    pressure.record(reduced.pressure[i] - exact.pressure[i]);
+                }
+                for (size_t i = 0; i < exact.velocity.size(); ++i) {
+                    velocity.record(reduced.velocity[i] - exact.velocity[i]);
+                }
+                auto exact_layout = reference->layout();
+                auto reduced_layout = candidate->layout();
+                cells_differing = 0;
+                for (size_t x = 0; x < exact_layout.size(); ++x) {
+                    for (size_t y = 0; y < exact_layout[x].size(); ++y) {
+                        cells_differing += exact_layout[x][y] != reduced_layout[x][y];
+                    }
+                }
+                most_cells_differing = std::max(most_cells_differing, cells_differing);
+            }
+            std::cout << "Deviation from full-width storage over " << steps << " ticks:\n"
+                      << "Pressure: max " << pressure.max_abs << ", rms " << pressure.rms() << "\n"
+                      << "Velocity: max " << velocity.max_abs << ", rms " << velocity.rms() << "\n"
+                      << "Cells of another material: " << cells_differing << " after the last tick, at most "
+                      << most_cells_differing << "\n";
+            return 0;
+        }
 
         std::unique_ptr<FluidSimulatorBase> simulator = createSimulatorInstance(
-            field_data_input, p_type_str, v_type_str, vf_type_str
+            field_data_input, p_type_str, v_type_str, vf_type_str, extent_mode
         );
+        simulator->set_options(options);
         simulator->run(steps, checkpoint_interval);
         auto end = std::chrono::high_resolution_clock::now();
 
@@ -0,0 +1,93 @@
+#include "packing.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace packing {
+    std::vector<Pack> packMaps(const std::vector<std::vector<std::string>>& maps, size_t max_cols) {
+        std::vector<Pack> packs;
+        // Gravity line and sorted density lines of each pack.
+        std::vector<std::string> physics;
+        std::vector<std::vector<std::string>> densities;
+        std::vector<std::vector<size_t>> members;
+
+        for (size_t i = 0; i < maps.size(); ++i) {
+            const auto& map = maps[i];
+            size_t rows = 0, cols = 0;
+            if (map.size() >= 2) {
+                std::stringstream(map[0]) >> rows >> cols;
+            }
+            if (rows == 0 || cols == 0 || map.size() < 2 + rows) {
+                throw std::runtime_error("Invalid map " + std::to_string(i) + " for packing");
+            }
+            std::vector<std::string> rho_lines;
+            for (size_t j = 2 + rows; j < map.size(); ++j) {
+                if (map[j].find('=') != std::string::npos) {
+                    rho_lines.push_back(map[j]);
+                }
+            }
+            std::sort(rho_lines.begin(), rho_lines.end());
+            std::string key = map[1];
+            for (const auto& line : rho_lines) {
+                key += "\n" + line;
+            }
+            size_t group = std::find(physics.begin(), physics.end(), key) - physics.begin();
+            if (group == physics.size()) {
+                physics.push_back(key);
+                densities.push_back(rho_lines);
+                members.emplace_back();
+            }
+            members[group].push_back(i);
+        }
+
+        for (size_t group = 0; group < members.size(); ++group) {
+            Pack pack;
+            size_t x = 0, y = 0, shelf_rows = 0, total_cols = 0;
+            for (size_t i : members[group]) {
+                size_t rows = 0, cols = 0;
+                std::stringstream(maps[i][0]) >> rows >> cols;
+                if (y > 0 && y + cols > max_cols) {
+                    x += shelf_rows + 1;
+                    y = 0;
+                    shelf_rows = 0;
+                }
+                pack.regions.push_back({x, y, rows, cols});
+                pack.sources.push_back(i);
+                shelf_rows = std::max(shelf_rows, rows);
+                total_cols = std::max(total_cols, y + cols);
+                y += cols + 1;
+            }
+            size_t total_rows = x + shelf_rows;
+
+            const auto& first = maps[members[group].front()];
+            pack.field_data.push_back(std::to_string(total_rows) + " " + std::to_string(total_cols));
+            pack.field_data.push_back(first[1]);
+            std::vector<std::string> cells(total_rows, std::string(total_cols, '#'));
+            for (size_t r = 0; r < pack.regions.size(); ++r) {
+                const auto& region = pack.regions[r];
+                const auto& map = maps[pack.sources[r]];
+                for (size_t row = 0; row < region.rows; ++row) {
+                    const std::string& line = map[2 + row];
+                    if (line.size() < region.cols) {
+                        throw std::runtime_error("Map " + std::to_string(pack.sources[r]) + " has a short row");
+                    }
+                    cells[region.x0 + row].replace(region.y0, region.cols, line, 0, region.cols);
+                }
+            }
+            pack.field_data.insert(pack.field_data.end(), cells.begin(), cells.end());
+            pack.field_data.insert(pack.field_data.end(), densities[group].begin(), densities[group].end());
+            packs.push_back(std::move(pack));
+        }
+        return packs;
+    }
+
+    std::vector<std::string> unpackLayout(const Pack& pack, size_t region,
+                                          const std::vector<std::string>& layout) {
+        const auto& r = pack.regions[region];
+        std::vector<std::string> cells;
+        for (size_t row = 0; row < r.rows; ++row) {
+            cells.push_back(layout[r.x0 + row].substr(r.y0, r.cols));
+        }
+        return cells;
+    }
+}
@@ -0,0 +1,282 @@
+#include "preview.h"
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    struct FieldFile {
+        size_t rows{0}, cols{0};
+        double g{0};
+        std::vector<std::string> layout;
+        std::vector<std::pair<char, double>> rho;
+    };
+
+    FieldFile parseFieldFile(const std::vector<std::string>& field_data) {
+        FieldFile f;
+        if (field_data.size() < 2) {
+            throw std::runtime_error("Field file is too short");
+        }
+        std::stringstream ss(field_data[0]);
+        ss >> f.rows >> f.cols;
+        f.g = std::stod(field_data[1]);
+        if (f.rows == 0 || f.cols == 0 || field_data.size() < 2 + f.rows) {
+            throw std::runtime_error("Invalid rows or cols");
+        }
+        for (size_t i = 0; i < f.rows; ++i) {
+            std::string line = field_data[2 + i];
+            line.resize(f.cols, ' ');
+            f.layout.push_back(line);
+        }
+        for (size_t i = 2 + f.rows; i < field_data.size(); ++i) {
+            const std::string& line = field_data[i];
+            size_t eq = line.find('=', 1);
+            if (line.empty() || eq == std::string::npos) continue;
+            f.rho.emplace_back(line[0], std::stod(line.substr(eq + 1)));
+        }
+        return f;
+    }
+
+    std::vector<std::string> formatFieldFile(const FieldFile& f) {
+        std::vector<std::string> out;
+        out.push_back(std::to_string(f.rows) + " " + std::to_string(f.cols));
+        std::ostringstream g_ss;
+        g_ss << std::setprecision(17) << f.g;
+        out.push_back(g_ss.str());
+        out.insert(out.end(), f.layout.begin(), f.layout.end());
+        for (const auto& [symbol, value] : f.rho) {
+            std::ostringstream rho_ss;
+            rho_ss << symbol << " = " << std::setprecision(17) << value;
+            out.push_back(rho_ss.str());
+        }
+        return out;
+    }
+
+    void checkFactor(size_t factor) {
+        if (factor == 0) {
+            throw std::runtime_error("Preview factor must be positive");
+        }
+    }
+}
+
+namespace preview {
+    std::vector<std::string> downsampleField(const std::vector<std::string>& field_data, size_t factor) {
+        checkFactor(factor);
+        FieldFile fine = parseFieldFile(field_data);
+        FieldFile coarse;
+        // Block (bx, by) covers the fine cells of block (bx - 1, by - 1) of
+        // the map; the extra ring of blocks around them holds no fine cells
+        // and stays wall, so the blocks at the edge of the map are voted
+        // and flooded like any other.
+        coarse.rows = (fine.rows + factor - 1) / factor + 2;
+        coarse.cols = (fine.cols + factor - 1) / factor + 2;
+        coarse.g = fine.g / static_cast<double>(factor);
+        coarse.layout.assign(coarse.rows, std::string(coarse.cols, '#'));
+
+        // Majority vote per block; walls win ties. `material` remembers the
+        // most common open material so that a walled block can be reopened.
+        std::vector<std::string> material(coarse.rows, std::string(coarse.cols, ' '));
+        for (size_t bx = 1; bx + 1 < coarse.rows; ++bx) {
+            for (size_t by = 1; by + 1 < coarse.cols; ++by) {
+                std::array<size_t, 256> counts{};
+                size_t open = 0, total = 0;
+                for (size_t x = (bx - 1) * factor; x < std::min(fine.rows, bx * factor); ++x) {
+                    for (size_t y = (by - 1) * factor; y < std::min(fine.cols, by * factor); ++y) {
+                        char c = fine.layout[x][y];
+                        ++total;
+                        if (c == '#') continue;
+                        ++counts[static_cast<unsigned char>(c)];
+                        ++open;
+                    }
+                }
+                size_t best = static_cast<unsigned char>(' ');
+                for (size_t c = 0; c < counts.size(); ++c) {
+                    if (counts[c] > counts[best]) best = c;
+                }
+                material[bx][by] = static_cast<char>(best);
+                if (2 * open > total) {
+                    coarse.layout[bx][by] = material[bx][by];
+                }
+            }
+        }
+
+        // Reopen walled blocks so that every connected region of the fine
+        // map stays a single connected region in the coarse map. Each fine
+        // region is flooded from its cells in open blocks; when two floods
+        // from different coarse regions meet, the blocks along both paths
+        // are opened.
+        size_t n_blocks = coarse.rows * coarse.cols;
+        std::vector<size_t> parent_block(n_blocks);
+        for (size_t i = 0; i < n_blocks; ++i) parent_block[i] = i;
+        auto find = [&](size_t b) {
+            while (parent_block[b] != b) b = parent_block[b] = parent_block[parent_block[b]];
+            return b;
+        };
+        auto block_of = [&](size_t cell) {
+            return (cell / fine.cols / factor + 1) * coarse.cols + (cell % fine.cols) / factor + 1;
+        };
+        auto is_open_block = [&](size_t b) {
+            return coarse.layout[b / coarse.cols][b % coarse.cols] != '#';
+        };
+        auto open_block = [&](size_t b) {
+            size_t bx = b / coarse.cols, by = b % coarse.cols;
+            if (coarse.layout[bx][by] != '#') return;
+            coarse.layout[bx][by] = material[bx][by];
+            const std::array<std::pair<int, int>, 4> deltas{{{-1, 0}, {1, 0}, {0, -1}, {0, 1}}};
+            for (auto [dx, dy] : deltas) {
+                size_t nx = bx + dx, ny = by + dy;
+                if (nx < coarse.rows && ny < coarse.cols && coarse.layout[nx][ny] != '#') {
+                    parent_block[find(nx * coarse.cols + ny)] = find(b);
+                }
+            }
+        };
+        for (size_t b = 0; b < n_blocks; ++b) {
+            if (!is_open_block(b)) continue;
+            size_t bx = b / coarse.cols, by = b % coarse.cols;
+            if (bx + 1 < coarse.rows && is_open_block(b + coarse.cols)) parent_block[find(b + coarse.cols)] = find(b);
+            if (by + 1 < coarse.cols && is_open_block(b + 1)) parent_block[find(b + 1)] = find(b);
+        }
+
+        size_t n_cells = fine.rows * fine.cols;
+        const size_t none = ~size_t(0);
+        std::vector<size_t> came_from(n_cells, none);
+        std::vector<size_t> source(n_cells, none);
+        std::vector<bool> seen(n_cells, false);
+        auto passable = [&](size_t cell) {
+            return fine.layout[cell / fine.cols][cell % fine.cols] != '#';
+        };
+        auto open_path = [&](size_t cell) {
+            for (; cell != none; cell = came_from[cell]) open_block(block_of(cell));
+        };
+
+        for (size_t start = 0; start < n_cells; ++start) {
+            if (seen[start] || !passable(start)) continue;
+
+            std::vector<size_t> region{start};
+            seen[start] = true;
+            bool has_fluid = false;
+            for (size_t i = 0; i < region.size(); ++i) {
+                size_t cell = region[i];
+                size_t x = cell / fine.cols, y = cell % fine.cols;
+                has_fluid |= fine.layout[x][y] != ' ';
+                const std::array<size_t, 4> next{cell - fine.cols, cell + fine.cols, cell - 1, cell + 1};
+                const std::array<bool, 4> valid{x > 0, x + 1 < fine.rows, y > 0, y + 1 < fine.cols};
+                for (size_t d = 0; d < 4; ++d) {
+                    if (valid[d] && !seen[next[d]] && passable(next[d])) {
+                        seen[next[d]] = true;
+                        region.push_back(next[d]);
+                    }
+                }
+            }
+
+            std::vector<size_t> queue;
+            for (size_t cell : region) {
+                if (is_open_block(block_of(cell))) {
+                    source[cell] = block_of(cell);
+                    queue.push_back(cell);
+                }
+            }
+            if (queue.empty()) {
+                if (!has_fluid) continue;
+                open_block(block_of(start));
+                source[start] = block_of(start);
+                queue.push_back(start);
+            }
+
+            for (size_t i = 0; i < queue.size(); ++i) {
+                size_t cell = queue[i];
+                size_t x = cell / fine.cols, y = cell % fine.cols;
+                const std::array<size_t, 4> next{cell - fine.cols, cell + fine.cols, cell - 1, cell + 1};
+                const std::array<bool, 4> valid{x > 0, x + 1 < fine.rows, y > 0, y + 1 < fine.cols};
+                for (size_t d = 0; d < 4; ++d) {
+                    if (!valid[d] || !passable(next[d])) continue;
+                    size_t n = next[d];
+                    if (source[n] == none) {
+                        source[n] = source[cell];
+                        came_from[n] = cell;
+                        queue.push_back(n);
+                    } else if (find(source[n]) != find(source[cell])) {
+                        open_path(cell);
+                        open_path(n);
+                        parent_block[find(source[n])] = find(source[cell]);
+                    }
+                }
+            }
+        }
+
+        double scale = static_cast<double>(factor) * static_cast<double>(factor);
+        for (const auto& [symbol, value] : fine.rho) {
+            coarse.rho.emplace_back(symbol, value * scale);
+        }
+        return formatFieldFile(coarse);
+    }
+
+    std::vector<std::string> upsampleField(const std::vector<std::string>& field_data,
+                                           const std::vector<std::string>& coarse_layout,
+                                           size_t factor) {
+        checkFactor(factor);
+        FieldFile fine = parseFieldFile(field_data);
+        for (size_t x = 0; x < fine.rows; ++x) {
+            for (size_t y = 0; y < fine.cols; ++y) {
+                if (fine.layout[x][y] == '#') continue;
+                size_t bx = x / factor + 1, by = y / factor + 1;
+                char c = bx < coarse_layout.size() && by < coarse_layout[bx].size()
+                    ? coarse_layout[bx][by] : ' ';
+                fine.layout[x][y] = c == '#' ? ' ' : c;
+            }
+        }
+        return formatFieldFile(fine);
+    }
+
+    void printReport(std::ostream& out,
+                     const std::vector<std::string>& field_data,
+                     const std::vector<std::string>& coarse_layout,
+                     size_t factor) {
+        checkFactor(factor);
+        FieldFile fine = parseFieldFile(field_data);
+
+        struct Extent {
+            size_t initial{0}, cells{0};
+            double row_sum{0};
+            size_t top{~size_t(0)}, bottom{0};
+        };
+        std::map<char, Extent> materials;
+        for (const auto& line : fine.layout) {
+            for (char c : line) {
+                if (c != '#' && c != ' ') ++materials[c].initial;
+            }
+        }
+        // Skips the wall ring downsampleField adds around the map.
+        for (size_t bx = 1; bx + 1 < coarse_layout.size(); ++bx) {
+            for (char c : coarse_layout[bx]) {
+                if (c == '#' || c == ' ') continue;
+                Extent& e = materials[c];
+                e.cells += factor * factor;
+                e.row_sum += (static_cast<double>(bx - 1) + 0.5) * factor * factor * factor;
+                e.top = std::min(e.top, (bx - 1) * factor);
+                e.bottom = std::max(e.bottom, std::min(fine.rows, bx * factor) - 1);
+            }
+        }
+
+        out << "\n=== Preview (factor " << factor << ", "
+            << coarse_layout.size() << "x" << (coarse_layout.empty() ? 0 : coarse_layout[0].size())
+            << " coarse cells) ===\n";
+        for (const auto& line : coarse_layout) {
+            out << line << "\n";
+        }
+        for (const auto& [c, e] : materials) {
+            out << "'" << c << "': " << e.initial << " cells initially, ~" << e.cells << " at end";
+            if (e.cells > 0) {
+                out << ", rows " << e.top << ".." << e.bottom
+                    << ", mean row " << e.row_sum / static_cast<double>(e.cells)
+                    << " of " << fine.rows;
+            } else {
+                out << ", drained";
+            }
+            out << "\n";
+        }
+        out << "===========================\n\n";
+    }
+}
@@ -0,0 +1,166 @@
+// Benchmarks the move sampling of include/sampling.h on its own: the
+// prefix sums over the masked move weights and the choice of a direction
+// from them. The weights are those of a simulated map after every tick,
+// masked as update_move_weights masks them, and the random fractions are
+// drawn up front, so the timed loop holds nothing but the two helpers.
+// Built with and without BRANCHY_SAMPLING by bench_sampling; both builds
+// must print the same checksum.
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <chrono>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <random>
+
+#include "simulator.h"
+#include "config.h"
+#include "sampling.h"
+#include "utils.h"
+
+namespace {
+    constexpr size_t D = NEIGHBOURHOOD::size;
+
+    class NullBuffer : public std::streambuf {
+    protected:
+        int overflow(int c) override { return c; }
+        std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    struct Cell {
+        std::array<float, D> weights;
+        std::array<bool, D> mask;
+    };
+
+    // Appends the open cells of the map with their velocities, the mask
+    // marking the directions into open cells with a positive velocity.
+    void collectCells(const FluidSimulatorBase& simulator, std::vector<Cell>& cells) {
+        auto layout = simulator.layout();
+        auto values = simulator.field_values();
+        size_t rows = layout.size(), cols = layout.empty() ? 0 : layout[0].size();
+        for (size_t x = 0; x < rows; ++x) {
+            for (size_t y = 0; y < cols; ++y) {
+                if (layout[x][y] == '#') {
+                    continue;
+                }
+                Cell cell{};
+                for (size_t i = 0; i < D; ++i) {
+                    size_t nx = x + NEIGHBOURHOOD::deltas[i].first, ny = y + NEIGHBOURHOOD::deltas[i].second;
+                    cell.weights[i] = static_cast<float>(values.velocity[(x * cols + y) * D + i]);
+                    cell.mask[i] = nx < rows && ny < cols && layout[nx][ny] != '#' && cell.weights[i] > 0.0f;
+                }
+                cells.push_back(cell);
+            }
+        }
+    }
+
+    // Samples a direction for every cell in passes of about `samples`
+    // draws in all and returns the median time per cell in nanoseconds;
+    // `checksum` sums the directions. Each pass shifts the fractions by one
+    // cell. Cells without weight stop after the prefix sums, as
+    // propagate_move does.
+    double measure(const std::vector<Cell>& cells, const std::vector<float>& fractions,
+                   size_t samples, size_t repeat, uint64_t& checksum) {
+        size_t passes = std::max<size_t>(1, samples / cells.size());
+        std::vector<double> times;
+        for (size_t run = 0; run <= repeat; ++run) {
+            uint64_t sum = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t pass = 0; pass < passes; ++pass) {
+                const float* fraction = fractions.data() + pass;
+                for (size_t c = 0; c < cells.size(); ++c) {
+                    auto thresholds = masked_prefix_sums(cells[c].weights, cells[c].mask);
+                    float total = thresholds[D - 1];
+                    if (total == 0.0f) {
+                        continue;
+                    }
+                    sum += sample_direction(thresholds, fraction[c] * total);
+                }
+            }
+            double ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+            // The first run warms the caches and is not counted.
+            if (run > 0) {
+                times.push_back(ns / (passes * cells.size()));
+            }
+            checksum = sum;
+        }
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* map_path = "data/default.txt";
+    size_t ticks = 100;
+    size_t samples = 50000000;
+    size_t repeat = 5;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--file" && i + 1 < argc) {
+            map_path = argv[++i];
+        } else if (arg == "--ticks" && i + 1 < argc) {
+            ticks = std::stoul(argv[++i]);
+        } else if (arg == "--samples" && i + 1 < argc) {
+            samples = std::stoul(argv[++i]);
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::stoul(argv[++i]);
+        }
+    }
+
+    try {
+        if (samples == 0 || repeat == 0) {
+            throw std::runtime_error("--samples and --repeat must be positive");
+        }
+        auto map = utils::readFieldFromFile(map_path);
+
+        // The simulator prints the map while it parses and moves.
+        NullBuffer null_buffer;
+        std::streambuf* console = std::cout.rdbuf(&null_buffer);
+        std::vector<Cell> all;
+        try {
+            auto simulator = createSimulatorInstance(map, "FLOAT", "FLOAT", "FLOAT");
+            for (size_t t = 0; t < ticks; ++t) {
+                simulator->tick();
+                collectCells(*simulator, all);
+            }
+        } catch (...) {
+            std::cout.rdbuf(console);
+            throw;
+        }
+        std::cout.rdbuf(console);
+
+        // The default sweep draws only for cells with move weight,
+        // --compat-rng for every open cell.
+        std::vector<Cell> weighted;
+        std::copy_if(all.begin(), all.end(), std::back_inserter(weighted), [](const Cell& cell) {
+            for (size_t i = 0; i < D; ++i) {
+                if (cell.mask[i]) return true;
+            }
+            return false;
+        });
+
+        std::mt19937 rnd(1337);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::vector<float> fractions(all.size() + samples / std::max<size_t>(1, weighted.size()));
+        for (auto& f : fractions) {
+            f = unit(rnd);
+        }
+
+        std::cout << "Map " << map_path << ", " << ticks << " ticks: "
+                  << all.size() << " open cells over the ticks, " << weighted.size() << " with move weight\n";
+        for (const auto* cells : {&weighted, &all}) {
+            uint64_t checksum = 0;
+            double ns = cells->empty() ? 0.0 : measure(*cells, fractions, samples, repeat, checksum);
+            std::cout << (cells == &all ? "Every open cell" : "Cells with weight") << ": "
+                      << ns << " ns per cell, checksum " << checksum << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}